@@ -0,0 +1,318 @@
+/*
+ * Copyright 2021 ETH Zurich
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Author: Robert Balas (balasr@iis.ee.ethz.ch)
+ */
+
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <llvm-c/Analysis.h>
+#include <llvm-c/BitWriter.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/Types.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "bytecode.h"
+#include "lower.h"
+#include "optimize.h"
+
+#define DIAG_SZ 256
+
+/*
+ * Ahead of time compilation of many programs at once. Every file gets its
+ * own context and module, so workers never share llvm state apart from the
+ * target registry which is initialized once up front. Errors are collected
+ * per file and reported in input order when all workers are done.
+ */
+
+struct batch_name {
+	char base[NAME_MAX];
+	char sym[NAME_MAX + 4];
+};
+
+struct batch {
+	char **paths;
+	int n;
+	const char *outdir;
+	bool bitcode;
+	bool metered;
+	atomic_int next;
+	struct batch_name *names;
+	char (*diag)[DIAG_SZ];
+};
+
+/* read a whole file into a null terminated buffer */
+static char *
+read_file(const char *path, char *diag)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		snprintf(diag, DIAG_SZ, " %s", strerror(errno));
+		return NULL;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	long len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	char *buffer = malloc(len + 1);
+	if (!buffer) {
+		snprintf(diag, DIAG_SZ, " %s", strerror(errno));
+		fclose(fp);
+		return NULL;
+	}
+	len = fread(buffer, 1, len, fp);
+	buffer[len] = '\0';
+	fclose(fp);
+
+	return buffer;
+}
+
+/* foo/bar-baz.bf -> bar-baz and bf_bar_baz */
+static void
+batch_names(const char *path, char base[NAME_MAX], char sym[NAME_MAX + 4])
+{
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s", path);
+	snprintf(base, NAME_MAX, "%s", basename(tmp));
+
+	char *dot = strrchr(base, '.');
+	if (dot && dot != base)
+		*dot = '\0';
+
+	snprintf(sym, NAME_MAX + 4, "bf_%s", base);
+	for (char *c = sym; *c; c++) {
+		if (!(*c >= 'a' && *c <= 'z') && !(*c >= 'A' && *c <= 'Z') &&
+		    !(*c >= '0' && *c <= '9'))
+			*c = '_';
+	}
+}
+
+static int
+batch_one(struct batch *b, LLVMTargetMachineRef tm, int i)
+{
+	char *diag = b->diag[i];
+	const char *base = b->names[i].base, *sym = b->names[i].sym;
+	char out[PATH_MAX];
+	char *err = NULL;
+	int status = 1;
+
+	snprintf(out, sizeof(out), "%s/%s.%s", b->outdir, base,
+	    b->bitcode ? "bc" : "o");
+
+	char *buffer = read_file(b->paths[i], diag);
+	if (!buffer)
+		return 1;
+
+	struct bf_insn *code = bf_try_compile(buffer, false, diag, DIAG_SZ);
+	free(buffer);
+	if (!code)
+		return 1;
+	bf_optimize(code, false);
+
+	LLVMContextRef ctx = LLVMContextCreate();
+	LLVMModuleRef mod = LLVMModuleCreateWithNameInContext(base, ctx);
+
+	LLVMValueRef fun = lower(code, mod, ctx, sym, NULL, b->metered, false);
+	free(code);
+
+	if (LLVMVerifyModule(mod, LLVMReturnStatusAction, &err)) {
+		snprintf(diag, DIAG_SZ, " invalid module: %s", err);
+		goto fail;
+	}
+
+	if (lower_optimize(mod, fun)) {
+		snprintf(diag, DIAG_SZ, " optimization failed");
+		goto fail;
+	}
+
+	if (b->bitcode) {
+		if (LLVMWriteBitcodeToFile(mod, out)) {
+			snprintf(diag, DIAG_SZ, " cannot write bitcode");
+			goto fail;
+		}
+	} else {
+		char *triple = LLVMGetTargetMachineTriple(tm);
+		LLVMTargetDataRef layout = LLVMCreateTargetDataLayout(tm);
+		LLVMSetTarget(mod, triple);
+		LLVMSetModuleDataLayout(mod, layout);
+		LLVMDisposeTargetData(layout);
+		LLVMDisposeMessage(triple);
+
+		if (LLVMTargetMachineEmitToFile(
+			tm, mod, out, LLVMObjectFile, &err)) {
+			snprintf(diag, DIAG_SZ, " %s", err);
+			goto fail;
+		}
+	}
+
+	status = 0;
+
+fail:
+	LLVMDisposeMessage(err);
+	LLVMDisposeModule(mod);
+	LLVMContextDispose(ctx);
+	return status;
+}
+
+/* names only depend on the basename, so a/x.bf and b/x.bf would overwrite
+ * each other's object and a-b.bf and a_b.bf would export the same symbol.
+ * Every program that clashes with an earlier one gets a diagnostic instead of
+ * being compiled. */
+static void
+batch_check_names(struct batch *b)
+{
+	for (int i = 0; i < b->n; i++) {
+		batch_names(b->paths[i], b->names[i].base, b->names[i].sym);
+		for (int j = 0; j < i; j++) {
+			if (b->diag[j][0])
+				continue;
+			if (!strcmp(b->names[i].base, b->names[j].base)) {
+				snprintf(b->diag[i], DIAG_SZ,
+				    " output is also written by %s", b->paths[j]);
+				break;
+			}
+			if (!strcmp(b->names[i].sym, b->names[j].sym)) {
+				snprintf(b->diag[i], DIAG_SZ,
+				    " symbol is also exported by %s", b->paths[j]);
+				break;
+			}
+		}
+	}
+}
+
+static LLVMTargetMachineRef
+batch_target_machine(void)
+{
+	char *triple = LLVMGetDefaultTargetTriple();
+	char *cpu = LLVMGetHostCPUName();
+	char *features = LLVMGetHostCPUFeatures();
+	char *err = NULL;
+	LLVMTargetRef target;
+	LLVMTargetMachineRef tm = NULL;
+
+	if (LLVMGetTargetFromTriple(triple, &target, &err)) {
+		fprintf(stderr, "bf: %s\n", err);
+		LLVMDisposeMessage(err);
+	} else {
+		tm = LLVMCreateTargetMachine(target, triple, cpu, features,
+		    LLVMCodeGenLevelDefault, LLVMRelocPIC,
+		    LLVMCodeModelDefault);
+	}
+
+	LLVMDisposeMessage(features);
+	LLVMDisposeMessage(cpu);
+	LLVMDisposeMessage(triple);
+	return tm;
+}
+
+static void *
+batch_worker(void *arg)
+{
+	struct batch *b = arg;
+
+	/* target machines are not thread safe, every worker owns one */
+	LLVMTargetMachineRef tm = NULL;
+	if (!b->bitcode)
+		tm = batch_target_machine();
+
+	int i;
+	while ((i = atomic_fetch_add(&b->next, 1)) < b->n) {
+		if (b->diag[i][0])
+			continue;
+		if (!b->bitcode && !tm)
+			snprintf(b->diag[i], DIAG_SZ, " no target machine");
+		else if (batch_one(b, tm, i) && !b->diag[i][0])
+			snprintf(b->diag[i], DIAG_SZ, " failed");
+	}
+
+	if (tm)
+		LLVMDisposeTargetMachine(tm);
+	return NULL;
+}
+
+int
+batch_compile(char **paths, int n, const char *outdir, bool bitcode,
+    bool metered, int jobs)
+{
+	struct batch b = {
+		.paths = paths,
+		.n = n,
+		.outdir = outdir,
+		.bitcode = bitcode,
+		.metered = metered,
+		.next = 0,
+		.names = malloc(n * sizeof(*b.names)),
+		.diag = calloc(n, sizeof(*b.diag)),
+	};
+
+	if (jobs < 1)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs > n)
+		jobs = n;
+
+	pthread_t *threads = malloc(jobs * sizeof(*threads));
+	if (!b.names || !b.diag || !threads) {
+		perror("malloc");
+		abort();
+	}
+
+	batch_check_names(&b);
+
+	LLVMInitializeNativeTarget();
+	LLVMInitializeNativeAsmPrinter();
+
+	int started = 0;
+	for (; started < jobs; started++) {
+		if (pthread_create(&threads[started], NULL, batch_worker, &b))
+			break;
+	}
+
+	/* fall back to compiling on this thread if we could not spawn any */
+	if (!started)
+		batch_worker(&b);
+
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	int status = 0;
+	int failed = 0;
+	for (int i = 0; i < n; i++) {
+		if (b.diag[i][0]) {
+			fprintf(stderr, "%s:%s\n", paths[i], b.diag[i]);
+			failed++;
+		}
+	}
+	if (failed) {
+		fprintf(stderr, "bf: %d of %d programs failed\n", failed, n);
+		status = 1;
+	}
+
+	free(threads);
+	free(b.names);
+	free(b.diag);
+	return status;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2021 ETH Zurich
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Author: Robert Balas (balasr@iis.ee.ethz.ch)
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "optimize.h"
+#include "run.h"
+#include "templatejit.h"
+#include "trace.h"
+
+/* run a program with the template jit. Same as brain2llvm -b, but without
+ * linking llvm, whose loading dominates the startup of short runs. */
+
+void
+usage(char **argv)
+{
+	fprintf(stderr,
+	    "usage:  %s [-v] [-f fuel] [-t trace.bin [-s period] [-l loop]] "
+	    "program.bf\n",
+	    argv[0]);
+	fprintf(stderr, "  -v  verbose, dump bytecode\n");
+	fprintf(stderr, "  -f  stop after executing about this many "
+			"instructions in loops\n");
+	fprintf(stderr, "  -t  record loop events to a trace file\n");
+	fprintf(stderr, "  -s  only record every period'th event\n");
+	fprintf(stderr, "  -l  only record events within the loop at this "
+			"bytecode index\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	int opt = 0;
+	bool verbose = false;
+	char *trace_path = NULL;
+	unsigned trace_sample = 1;
+	int trace_loop = -1;
+	bool metered = false;
+	int64_t fuel = 0;
+
+	while ((opt = getopt(argc, argv, "vf:t:s:l:")) != -1) {
+		switch (opt) {
+		case 'v':
+			verbose = true;
+			break;
+		case 'f':
+			metered = true;
+			fuel = strtoll(optarg, NULL, 0);
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 's':
+			trace_sample = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			trace_loop = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv);
+		}
+	}
+
+	/* missing mandatory file arg */
+	if (optind >= argc)
+		usage(argv);
+
+	char *buffer = run_read(argv[optind]);
+
+	struct bf_insn *code = bf_compile(buffer, verbose);
+	bf_optimize(code, verbose);
+
+	struct bf_trace *trace = NULL;
+	if (trace_path) {
+		trace = trace_open(trace_path, trace_sample, trace_loop);
+		if (!trace)
+			exit(EXIT_FAILURE);
+	}
+
+	struct bf_template *tmpl = template_compile(
+	    code, trace, metered, verbose);
+	int status = run(tmpl->fn, fuel);
+
+	template_free(tmpl);
+	trace_close(trace);
+	free(code);
+	free(buffer);
+	return status;
+}
@@ -0,0 +1,246 @@
+/*
+ * Copyright 2021 ETH Zurich
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Author: Robert Balas (balasr@iis.ee.ethz.ch)
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "trace.h"
+
+/* decode a trace written by brain2llvm -t */
+
+struct loop_stat {
+	int pc;
+	uint64_t entered;
+	uint64_t skipped;
+	uint64_t iterations;
+	uint64_t ns;
+};
+
+void
+usage(char **argv)
+{
+	fprintf(stderr, "usage:  %s [-f text|hist|chrome] trace.bin\n",
+	    argv[0]);
+	exit(EXIT_FAILURE);
+}
+
+void
+print_text(struct bf_trace_rec *recs, uint64_t first, uint64_t last,
+    uint32_t mask)
+{
+	for (uint64_t i = first; i < last; i++) {
+		struct bf_trace_rec *r = &recs[i & mask];
+		printf("%8u %-8s head=%d val=%d dt=%luns\n", r->pc,
+		    bf_op_name(r->op), r->head, r->val, (unsigned long)r->dt);
+	}
+}
+
+int
+cmp_stat(const void *a, const void *b)
+{
+	const struct loop_stat *x = a, *y = b;
+	if (x->ns != y->ns)
+		return x->ns < y->ns ? 1 : -1;
+	return x->pc - y->pc;
+}
+
+void
+print_hist(struct bf_trace_rec *recs, uint64_t first, uint64_t last,
+    uint32_t mask)
+{
+	struct loop_stat *stats = NULL;
+	int n = 0;
+	uint64_t total = 0;
+
+	for (uint64_t i = first; i < last; i++) {
+		struct bf_trace_rec *r = &recs[i & mask];
+		struct loop_stat *s = NULL;
+
+		for (int j = 0; j < n; j++) {
+			if (stats[j].pc == (int)r->pc) {
+				s = &stats[j];
+				break;
+			}
+		}
+		if (!s) {
+			stats = realloc(stats, (n + 1) * sizeof(*stats));
+			if (!stats) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+			s = &stats[n++];
+			memset(s, 0, sizeof(*s));
+			s->pc = r->pc;
+		}
+
+		if (r->op == BF_LOOP && r->val)
+			s->entered++;
+		else if (r->op == BF_LOOP)
+			s->skipped++;
+		else
+			s->iterations++;
+		/* attribute the time since the last event to this loop */
+		s->ns += r->dt;
+		total += r->dt;
+	}
+
+	qsort(stats, n, sizeof(*stats), cmp_stat);
+
+	printf("%8s %12s %12s %14s %12s\n", "loop", "entered", "skipped",
+	    "iterations", "time(us)");
+	for (int j = 0; j < n; j++) {
+		struct loop_stat *s = &stats[j];
+		int bar = total ? (int)(40 * s->ns / total) : 0;
+
+		printf("%8d %12lu %12lu %14lu %12.1f ", s->pc,
+		    (unsigned long)s->entered, (unsigned long)s->skipped,
+		    (unsigned long)s->iterations, s->ns / 1000.0);
+		for (int k = 0; k < bar; k++)
+			putchar('#');
+		putchar('\n');
+	}
+	free(stats);
+}
+
+static void
+print_event(bool *comma, int pc, const char *ph, uint64_t ts, int head)
+{
+	printf("%s{\"name\":\"loop %d\",\"ph\":\"%s\",\"ts\":%.3f,"
+	       "\"pid\":1,\"tid\":1,%s\"args\":{\"head\":%d}}\n",
+	    *comma ? "," : "", pc, ph, ts / 1000.0,
+	    *ph == 'i' ? "\"s\":\"t\"," : "", head);
+	*comma = true;
+}
+
+/* loops become duration events, load it in chrome://tracing or perfetto.
+ * Entries and exits only pair up if we have every event, so a sampled or
+ * wrapped trace becomes instant events instead. */
+void
+print_chrome(struct bf_trace_rec *recs, uint64_t first, uint64_t last,
+    uint32_t mask, bool complete)
+{
+	uint64_t ts = 0;
+	bool comma = false;
+	/* loops we are in, innermost last */
+	int *open = malloc((last - first + 1) * sizeof(*open));
+	int depth = 0;
+
+	if (!open) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	puts("{\"traceEvents\":[");
+	for (uint64_t i = first; i < last; i++) {
+		struct bf_trace_rec *r = &recs[i & mask];
+
+		ts += r->dt;
+		if (!complete) {
+			print_event(&comma, r->pc, "i", ts, r->head);
+		} else if (r->op == BF_LOOP && r->val) {
+			open[depth++] = r->pc;
+			print_event(&comma, r->pc, "B", ts, r->head);
+		} else if (r->op == BF_END_LOOP && !r->val && depth &&
+		    open[depth - 1] == (int)r->pc) {
+			depth--;
+			print_event(&comma, r->pc, "E", ts, r->head);
+		}
+	}
+
+	/* the program stopped inside these, e.g. out of fuel */
+	while (depth)
+		print_event(&comma, open[--depth], "E", ts, 0);
+	puts("]}");
+
+	free(open);
+}
+
+int
+main(int argc, char **argv)
+{
+	int opt = 0;
+	char *format = "text";
+
+	while ((opt = getopt(argc, argv, "f:")) != -1) {
+		switch (opt) {
+		case 'f':
+			format = optarg;
+			break;
+		default:
+			usage(argv);
+		}
+	}
+
+	if (optind >= argc)
+		usage(argv);
+
+	int fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		exit(EXIT_FAILURE);
+	}
+
+	struct bf_trace_hdr *hdr = NULL;
+	if ((size_t)st.st_size >= sizeof(*hdr))
+		hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (!hdr || hdr == MAP_FAILED || hdr->magic != TRACE_MAGIC ||
+	    (size_t)st.st_size <
+		sizeof(*hdr) + (size_t)hdr->size * sizeof(struct bf_trace_rec)) {
+		fprintf(stderr, "%s is not a trace\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	struct bf_trace_rec *recs = (struct bf_trace_rec *)(hdr + 1);
+	uint64_t last = hdr->count;
+	/* older records have been overwritten */
+	uint64_t first = last > hdr->size ? last - hdr->size : 0;
+	uint32_t mask = hdr->size - 1;
+
+	if (!strcmp(format, "text")) {
+		printf("trace: %lu records, %lu dropped, sampling 1/%u\n",
+		    (unsigned long)last, (unsigned long)first, hdr->sample);
+		print_text(recs, first, last, mask);
+	} else if (!strcmp(format, "hist")) {
+		print_hist(recs, first, last, mask);
+	} else if (!strcmp(format, "chrome")) {
+		print_chrome(recs, first, last, mask,
+		    hdr->sample == 1 && first == 0);
+	} else {
+		usage(argv);
+	}
+
+	munmap(hdr, st.st_size);
+	close(fd);
+	return EXIT_SUCCESS;
+}
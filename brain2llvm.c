@@ -23,17 +23,21 @@
 #include <llvm-c/Core.h>
 #include <llvm-c/Error.h>
 #include <llvm-c/Orc.h>
-#include <llvm-c/Transforms/PassManagerBuilder.h>
 #include <llvm-c/Types.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#define BF_MEM_SZ (64 * 1024)
-#define BB_STACK_SZ (64 * 1024)
-
-LLVMBasicBlockRef bb_stack[BB_STACK_SZ] = { 0 };
+#include "batch.h"
+#include "bytecode.h"
+#include "lower.h"
+#include "optimize.h"
+#include "run.h"
+#include "templatejit.h"
+#include "trace.h"
 
 int
 handle_error(LLVMErrorRef err)
@@ -44,293 +48,88 @@ handle_error(LLVMErrorRef err)
 	return 1;
 }
 
-void
-print_bb(LLVMValueRef fun)
-{
-	LLVMBasicBlockRef bb = NULL;
-	for (bb = LLVMGetFirstBasicBlock(fun); bb;
-	     bb = LLVMGetNextBasicBlock(bb)) {
-		printf("bb: %s\n", LLVMGetBasicBlockName(bb));
-		if (LLVMGetBasicBlockTerminator(bb))
-			puts("ok ");
-		else
-			puts("NO TERMINATOR");
-
-		LLVMValueRef insn = NULL;
-		for (insn = LLVMGetFirstInstruction(bb); insn;
-		     insn = LLVMGetNextInstruction(insn)) {
-			printf("insn: %d\n", LLVMGetInstructionOpcode(insn));
-		}
-	}
-}
-
-/* lower brainfuck to llvm */
-LLVMValueRef
-lower(char *prog, LLVMModuleRef mod, LLVMContextRef ctx, bool trace)
+/* collect programs from the command line and the manifest, one path per
+ * line, and hand them to the batch compiler */
+int
+batch_main(char **files, int n, char *manifest, char *outdir, bool bitcode,
+    bool metered, int jobs)
 {
+	char **paths = malloc(n * sizeof(*paths));
+	int cap = n;
+	const int argn = n;
 
-	/* link putchar() and getchar() externally */
-	LLVMTypeRef putchar_args[] = { LLVMInt32TypeInContext(ctx) };
-	LLVMTypeRef getchar_args[] = {};
-
-	LLVMTypeRef putchar_type = LLVMFunctionType(
-	    LLVMInt32TypeInContext(ctx), putchar_args, 1, false);
-	LLVMTypeRef getchar_type = LLVMFunctionType(
-	    LLVMInt32TypeInContext(ctx), getchar_args, 0, false);
-
-	LLVMValueRef putchar_fun = LLVMAddFunction(
-	    mod, "putchar", putchar_type);
-	LLVMValueRef getchar_fun = LLVMAddFunction(
-	    mod, "getchar", getchar_type);
-
-	LLVMSetLinkage(putchar_fun, LLVMExternalLinkage);
-	LLVMSetLinkage(getchar_fun, LLVMExternalLinkage);
-
-	/* add jitted function */
-	LLVMTypeRef jitted_args[] = {};
-	LLVMTypeRef jitted_type = LLVMFunctionType(
-	    LLVMVoidTypeInContext(ctx), jitted_args, 0, false);
-	LLVMValueRef jitted_fun = LLVMAddFunction(mod, "jitted", jitted_type);
-
-	LLVMSetLinkage(jitted_fun, LLVMExternalLinkage);
-
-	LLVMBasicBlockRef entry_bb = LLVMAppendBasicBlockInContext(
-	    ctx, jitted_fun, "entry");
-
-	LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
-	LLVMPositionBuilderAtEnd(builder, entry_bb);
-
-	/* create tape memory on stack and zero it */
-	LLVMValueRef mem = LLVMBuildArrayAlloca(builder,
-	    LLVMInt8TypeInContext(ctx),
-	    LLVMConstInt(LLVMInt32TypeInContext(ctx), BF_MEM_SZ, false), "mem");
-	LLVMBuildMemSet(builder, mem,
-	    LLVMConstInt(LLVMInt8TypeInContext(ctx), 0, false),
-	    LLVMConstInt(LLVMInt32TypeInContext(ctx), BF_MEM_SZ, false), 0);
-
-	/* tape pointer, init to zero */
-	LLVMValueRef tape_ptr = LLVMBuildAlloca(
-	    builder, LLVMInt32TypeInContext(ctx), "tape_ptr");
-	LLVMBuildStore(builder,
-	    LLVMConstInt(LLVMInt32TypeInContext(ctx), 0, false), tape_ptr);
-
-	int bb_index = 0;
-
-	while (*prog) {
-		LLVMValueRef gep_args[1] = { 0 };
-		LLVMValueRef call_args[1] = { 0 };
-		LLVMValueRef load, decr, incr;
-		LLVMValueRef ele_ptr, load_ele, incr_ele, decr_ele;
-		LLVMValueRef cast, offset;
-		LLVMValueRef user;
-		LLVMValueRef cmp;
-
-		LLVMBasicBlockRef loop_bb = NULL;
-		LLVMBasicBlockRef exit_bb = NULL;
-
-		if (trace)
-			printf("lower: lowering '%c'\n", *prog);
-
-		switch (*prog) {
-		case ',':
-			/* getchar */
-			call_args[0] = 0;
-			user = LLVMBuildCall(
-			    builder, getchar_fun, call_args, 0, "call_comma");
-			cast = LLVMBuildIntCast2(builder, user,
-			    LLVMInt8TypeInContext(ctx), false, "cast_int2char");
-			offset = LLVMBuildLoad2(builder,
-			    LLVMInt32TypeInContext(ctx), tape_ptr, "offset");
-			gep_args[0] = offset;
-			ele_ptr = LLVMBuildInBoundsGEP2(builder,
-			    LLVMInt8TypeInContext(ctx), mem, gep_args, 1,
-			    "ele_ptr");
-			LLVMBuildStore(builder, cast, ele_ptr);
-
-			prog++;
-			break;
-
-		case '.':
-			/* putchar. Note we need to cast char to int */
-			offset = LLVMBuildLoad2(builder,
-			    LLVMInt32TypeInContext(ctx), tape_ptr, "offset");
-			gep_args[0] = offset;
-			ele_ptr = LLVMBuildInBoundsGEP2(builder,
-			    LLVMInt8TypeInContext(ctx), mem, gep_args, 1,
-			    "ele_ptr");
-			load_ele = LLVMBuildLoad2(builder,
-			    LLVMInt8TypeInContext(ctx), ele_ptr, "load_ele");
-			cast = LLVMBuildIntCast2(builder, load_ele,
-			    LLVMInt32TypeInContext(ctx), false,
-			    "cast_char2int");
-			call_args[0] = cast;
-			LLVMBuildCall(
-			    builder, putchar_fun, call_args, 1, "call_dot");
-
-			prog++;
-			break;
-
-		case '-':
-			offset = LLVMBuildLoad2(builder,
-			    LLVMInt32TypeInContext(ctx), tape_ptr, "offset");
-			gep_args[0] = offset;
-			ele_ptr = LLVMBuildInBoundsGEP2(builder,
-			    LLVMInt8TypeInContext(ctx), mem, gep_args, 1,
-			    "ele_ptr");
-			load_ele = LLVMBuildLoad2(builder,
-			    LLVMInt8TypeInContext(ctx), ele_ptr, "load_ele");
-			decr_ele = LLVMBuildSub(builder, load_ele,
-			    LLVMConstInt(LLVMInt8TypeInContext(ctx), 1, false),
-			    "decr_ele");
-			LLVMBuildStore(builder, decr_ele, ele_ptr);
-
-			prog++;
-			break;
-
-		case '+':
-			offset = LLVMBuildLoad2(builder,
-			    LLVMInt32TypeInContext(ctx), tape_ptr, "offset");
-			gep_args[0] = offset;
-			ele_ptr = LLVMBuildInBoundsGEP2(builder,
-			    LLVMInt8TypeInContext(ctx), mem, gep_args, 1,
-			    "ele_ptr");
-			load_ele = LLVMBuildLoad2(builder,
-			    LLVMInt8TypeInContext(ctx), ele_ptr, "load_ele");
-			incr_ele = LLVMBuildAdd(builder, load_ele,
-			    LLVMConstInt(LLVMInt8TypeInContext(ctx), 1, false),
-			    "incr_ele");
-			LLVMBuildStore(builder, incr_ele, ele_ptr);
-
-			prog++;
-			break;
-
-		case '<':
-			/* decrement pointed value */
-			load = LLVMBuildLoad2(builder,
-			    LLVMInt32TypeInContext(ctx), tape_ptr, "load");
-			decr = LLVMBuildSub(builder, load,
-			    LLVMConstInt(LLVMInt32TypeInContext(ctx), 1, false),
-			    "decr");
-			LLVMBuildStore(builder, decr, tape_ptr);
-
-			prog++;
-			break;
-
-		case '>':
-			/* increment pointed value */
-			load = LLVMBuildLoad2(builder,
-			    LLVMInt32TypeInContext(ctx), tape_ptr, "load");
-			incr = LLVMBuildAdd(builder, load,
-			    LLVMConstInt(LLVMInt32TypeInContext(ctx), 1, false),
-			    "incr");
-			LLVMBuildStore(builder, incr, tape_ptr);
-
-			prog++;
-			break;
-
-		case '[':
-			/* load value under tape_ptr */
-			offset = LLVMBuildLoad2(builder,
-			    LLVMInt32TypeInContext(ctx), tape_ptr, "offset");
-			gep_args[0] = offset;
-			ele_ptr = LLVMBuildInBoundsGEP2(builder,
-			    LLVMInt8TypeInContext(ctx), mem, gep_args, 1,
-			    "ele_ptr");
-			load_ele = LLVMBuildLoad2(builder,
-			    LLVMInt8TypeInContext(ctx), ele_ptr, "load_ele");
-
-			/* branch depending whether it's zero or not */
-			cmp = LLVMBuildICmp(builder, LLVMIntEQ, load_ele,
-			    LLVMConstInt(LLVMInt8TypeInContext(ctx), 0, false),
-			    "cmp_zero");
-
-			/* creat loop body block and skip block */
-			loop_bb = LLVMAppendBasicBlockInContext(
-			    ctx, jitted_fun, "loop_body");
-			exit_bb = LLVMAppendBasicBlockInContext(
-			    ctx, jitted_fun, "loop_exit");
-
-			/* if cmp is zero, then exit loop, else loop */
-			LLVMBuildCondBr(builder, cmp, exit_bb, loop_bb);
-
-			/* push loop and exit to stack for nesting  of [ */
-			if (bb_index >= BB_STACK_SZ - 2) {
-				fprintf(
-				    stderr, "bf: basic block stack overflow\n");
-				abort();
-			}
-			bb_stack[bb_index++] = loop_bb;
-			bb_stack[bb_index++] = exit_bb;
-
-			/* continue inserting bb's to loop body */
-			LLVMPositionBuilderAtEnd(builder, loop_bb);
+	if (n && !paths) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(paths, files, n * sizeof(*paths));
 
-			prog++;
-			break;
+	FILE *fp = NULL;
+	if (manifest && !(fp = fopen(manifest, "r"))) {
+		fprintf(stderr, "%s does not exist\n", manifest);
+		exit(EXIT_FAILURE);
+	}
 
-		case ']':
-			if (bb_index == 0) {
-				fprintf(stderr, "bf: unmatched closing ']'\n");
-				abort();
-			} else if (bb_index < 2) {
-				fprintf(stderr,
-				    "bf: basic block stack underflow\n");
-				abort();
+	char *line = NULL;
+	size_t line_sz = 0;
+	ssize_t len;
+	while (fp && (len = getline(&line, &line_sz, fp)) != -1) {
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (!len)
+			continue;
+
+		if (n == cap) {
+			cap = cap ? 2 * cap : 64;
+			paths = realloc(paths, cap * sizeof(*paths));
+			if (!paths) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
 			}
-
-			/* pop from stack */
-			exit_bb = bb_stack[--bb_index];
-			loop_bb = bb_stack[--bb_index];
-
-			offset = LLVMBuildLoad2(builder,
-			    LLVMInt32TypeInContext(ctx), tape_ptr, "offset");
-			gep_args[0] = offset;
-			ele_ptr = LLVMBuildInBoundsGEP2(builder,
-			    LLVMInt8TypeInContext(ctx), mem, gep_args, 1,
-			    "ele_ptr");
-			load_ele = LLVMBuildLoad2(builder,
-			    LLVMInt8TypeInContext(ctx), ele_ptr, "load_ele");
-
-			/* branch depending whether it's zero or not */
-			cmp = LLVMBuildICmp(builder, LLVMIntNE, load_ele,
-			    LLVMConstInt(LLVMInt8TypeInContext(ctx), 0, false),
-			    "cmp_not_zero");
-
-			/* if cmp is zero, then exit loop, else loop */
-			LLVMBuildCondBr(builder, cmp, loop_bb, exit_bb);
-
-			/* continue inserting bb's *after* loop body*/
-			LLVMPositionBuilderAtEnd(builder, exit_bb);
-
-			prog++;
-			break;
-
-		case ' ':
-		case '\n':
-		case '\t':
-			prog++;
-			break;
-
-		default:
-			fprintf(stderr, "bf: bad character '%c'\n", *prog);
-			abort();
-			break;
 		}
+		paths[n++] = strdup(line);
 	}
+	free(line);
+	if (fp)
+		fclose(fp);
+
+	if (!n)
+		return EXIT_SUCCESS;
 
-	/* no return value */
-	LLVMBuildRetVoid(builder);
+	int status = batch_compile(paths, n, outdir, bitcode, metered, jobs);
 
-	if (trace)
-		print_bb(jitted_fun);
+	/* entries past the command line ones came from the manifest */
+	for (int i = argn; i < n; i++)
+		free(paths[i]);
+	free(paths);
+	LLVMShutdown();
 
-	return jitted_fun;
+	return status ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 void
 usage(char **argv)
 {
-	fprintf(stderr, "usage:  %s [-v] program.bf\n", argv[0]);
+	fprintf(stderr,
+	    "usage:  %s [-v] [-b] [-f fuel] [-t trace.bin [-s period] "
+	    "[-l loop]] program.bf\n"
+	    "        %s -o outdir [-e obj|bc] [-j jobs] [-f fuel] "
+	    "[-m manifest] program.bf...\n",
+	    argv[0], argv[0]);
+	fprintf(stderr, "  -v  verbose, dump bytecode and ir\n");
+	fprintf(stderr, "  -b  use the baseline template jit instead of llvm, "
+			"see bfrun\n");
+	fprintf(stderr, "  -f  stop after executing about this many "
+			"instructions in loops\n");
+	fprintf(stderr, "  -t  record loop events to a trace file\n");
+	fprintf(stderr, "  -s  only record every period'th event\n");
+	fprintf(stderr, "  -l  only record events within the loop at this "
+			"bytecode index\n");
+	fprintf(stderr, "  -o  compile every program to an object in outdir\n");
+	fprintf(stderr, "  -e  emit objects (default) or bitcode\n");
+	fprintf(stderr, "  -j  compile on this many threads, default one per "
+			"core\n");
+	fprintf(stderr, "  -m  also compile the programs listed in this file\n");
 	exit(EXIT_FAILURE);
 }
 
@@ -341,43 +140,94 @@ main(int argc, char **argv)
 
 	int opt = 0;
 	bool verbose = false;
-
-	while ((opt = getopt(argc, argv, "v")) != -1) {
+	bool baseline = false;
+	char *trace_path = NULL;
+	unsigned trace_sample = 1;
+	int trace_loop = -1;
+	bool metered = false;
+	int64_t fuel = 0;
+	char *outdir = NULL;
+	char *manifest = NULL;
+	bool bitcode = false;
+	int jobs = 0;
+
+	while ((opt = getopt(argc, argv, "vbf:t:s:l:o:m:e:j:")) != -1) {
 		switch (opt) {
 		case 'v':
 			verbose = true;
 			break;
+		case 'b':
+			baseline = true;
+			break;
+		case 'f':
+			metered = true;
+			fuel = strtoll(optarg, NULL, 0);
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 's':
+			trace_sample = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			trace_loop = strtol(optarg, NULL, 0);
+			break;
+		case 'o':
+			outdir = optarg;
+			break;
+		case 'm':
+			manifest = optarg;
+			break;
+		case 'e':
+			if (!strcmp(optarg, "bc"))
+				bitcode = true;
+			else if (strcmp(optarg, "obj"))
+				usage(argv);
+			break;
+		case 'j':
+			jobs = strtol(optarg, NULL, 0);
+			break;
 		default:
 			usage(argv);
 		}
 	}
 
+	/* compile many programs ahead of time instead of running one */
+	if (outdir) {
+		if (trace_path || baseline)
+			usage(argv);
+		return batch_main(argv + optind, argc - optind, manifest,
+		    outdir, bitcode, metered, jobs);
+	}
+
 	/* missing mandatory file arg */
 	if (optind >= argc)
 		usage(argv);
 
-	/* parse input */
-	char *buffer = NULL;
-	size_t len = 0;
-	FILE *fp = fopen(argv[optind], "r");
+	char *buffer = run_read(argv[optind]);
 
-	if (!fp) {
-		fprintf(stderr, "%s does not exist\n", argv[optind]);
-		exit(EXIT_FAILURE);
+	/* fold and optimize, both backends work on the bytecode */
+	struct bf_insn *code = bf_compile(buffer, verbose);
+	bf_optimize(code, verbose);
+
+	struct bf_trace *trace = NULL;
+	if (trace_path) {
+		trace = trace_open(trace_path, trace_sample, trace_loop);
+		if (!trace)
+			exit(EXIT_FAILURE);
 	}
 
-	/* read into buffer and null terminate */
-	fseek(fp, 0, SEEK_END);
-	len = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-	buffer = malloc(len + 1);
-	if (!buffer) {
-		perror("malloc");
-		exit(EXIT_FAILURE);
+	/* skip llvm's initialization, bfrun does not even load it */
+	if (baseline) {
+		struct bf_template *tmpl = template_compile(
+		    code, trace, metered, verbose);
+		status = run(tmpl->fn, fuel);
+		template_free(tmpl);
+		trace_close(trace);
+		free(code);
+		free(buffer);
+		return status;
 	}
-	fread(buffer, 1, len, fp);
-	buffer[len] = '\0';
-	fclose(fp);
 
 	/* llvm  jit thread context (we don't really make use of this feature
 	 * though) */
@@ -387,7 +237,9 @@ main(int argc, char **argv)
 	LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("brain", ctx);
 
 	/* lower to llvm ir */
-	LLVMValueRef jitted_fun = lower(buffer, mod, ctx, verbose);
+	LLVMValueRef jitted_fun = lower(
+	    code, mod, ctx, "jitted", trace, metered, verbose);
+	free(code);
 
 	/* dump unoptimized ir if we want */
 	if (verbose && LLVMWriteBitcodeToFile(mod, "brain2llvm-pre-opt.bc")) {
@@ -400,28 +252,9 @@ main(int argc, char **argv)
 	LLVMVerifyModule(mod, LLVMAbortProcessAction, &error);
 	LLVMDisposeMessage(error);
 
-
 	/* apply optimization passes to ir */
-	LLVMPassManagerBuilderRef pass_builder = LLVMPassManagerBuilderCreate();
-	LLVMPassManagerBuilderSetOptLevel(pass_builder, 2);
-
-	LLVMPassManagerRef pm = LLVMCreatePassManager();
-	LLVMPassManagerRef fun_pm = LLVMCreateFunctionPassManagerForModule(mod);
-
-	LLVMPassManagerBuilderPopulateModulePassManager(pass_builder, pm);
-	LLVMPassManagerBuilderPopulateFunctionPassManager(pass_builder, fun_pm);
-
-	LLVMInitializeFunctionPassManager(fun_pm);
-
-	if (!LLVMRunFunctionPassManager(fun_pm, jitted_fun)) {
-		fprintf(stderr, "fun opt passes failed to apply\n");
-		exit(EXIT_FAILURE);
-	}
-
-	if (!LLVMRunPassManager(pm, mod)) {
-		fprintf(stderr, "opt passes failed to apply\n");
+	if (lower_optimize(mod, jitted_fun))
 		exit(EXIT_FAILURE);
-	}
 
 	/* dump optimized ir if we want */
 	if (verbose && LLVMWriteBitcodeToFile(mod, "brain2llvm-opt.bc")) {
@@ -435,6 +268,8 @@ main(int argc, char **argv)
 	LLVMInitializeCore(LLVMGetGlobalPassRegistry());
 
 	LLVMInitializeNativeTarget();
+	/* traced code contains inline asm */
+	LLVMInitializeNativeAsmParser();
 	LLVMInitializeNativeAsmPrinter();
 
 	/* create jit instance */
@@ -473,10 +308,7 @@ main(int argc, char **argv)
 		goto jit_fail;
 	}
 
-	void (*jitted_ptr)(void) = (void (*)(void))jitted_addr;
-
-	/* enter jitted code */
-	jitted_ptr();
+	status = run((bf_jitted_fn)jitted_addr, fuel);
 
 jit_fail:
 	/* destroy jit instance. This may fail! */
@@ -487,6 +319,7 @@ jit_fail:
 	}
 
 orc_llvm_fail:
+	trace_close(trace);
 	LLVMShutdown();
 
 	return status;
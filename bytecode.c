@@ -0,0 +1,265 @@
+/*
+ * Copyright 2021 ETH Zurich
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Author: Robert Balas (balasr@iis.ee.ethz.ch)
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+
+/* fold brainfuck source into bytecode. On errors we return NULL and describe
+ * what went wrong in err. The caller frees the result. */
+struct bf_insn *
+bf_try_compile(char *prog, bool trace, char *err, size_t err_sz)
+{
+	size_t len = strlen(prog);
+	/* we never emit more than one instruction per character */
+	struct bf_insn *code = malloc((len + 1) * sizeof(*code));
+	int *loop_stack = malloc((len + 1) * sizeof(*loop_stack));
+	/* source position of each open [, for error messages */
+	int *line_stack = malloc((len + 1) * sizeof(*line_stack));
+	int *col_stack = malloc((len + 1) * sizeof(*col_stack));
+	int n = 0;     /* number of emitted instructions */
+	int depth = 0; /* loop nesting */
+	int line = 1, col = 0;
+
+	if (!code || !loop_stack || !line_stack || !col_stack) {
+		perror("malloc");
+		abort();
+	}
+
+	for (; *prog; prog++) {
+		int start;
+
+		col++;
+
+		switch (*prog) {
+		case '+':
+		case '-':
+			if (n == 0 || code[n - 1].op != BF_ADD)
+				code[n++] = (struct bf_insn) { BF_ADD, 0 };
+			code[n - 1].arg += *prog == '+' ? 1 : -1;
+			/* drop operations that cancel out */
+			if (code[n - 1].arg == 0)
+				n--;
+			break;
+		case '>':
+		case '<':
+			if (n == 0 || code[n - 1].op != BF_MOVE)
+				code[n++] = (struct bf_insn) { BF_MOVE, 0 };
+			code[n - 1].arg += *prog == '>' ? 1 : -1;
+			if (code[n - 1].arg == 0)
+				n--;
+			break;
+		case '.':
+			code[n++] = (struct bf_insn) { BF_OUT, 0 };
+			break;
+		case ',':
+			code[n++] = (struct bf_insn) { BF_IN, 0 };
+			break;
+		case '[':
+			line_stack[depth] = line;
+			col_stack[depth] = col;
+			loop_stack[depth++] = n;
+			code[n++] = (struct bf_insn) { BF_LOOP, 0 };
+			break;
+		case ']':
+			if (depth == 0) {
+				snprintf(err, err_sz, "%d:%d: unmatched ']'",
+				    line, col);
+				goto fail;
+			}
+			start = loop_stack[--depth];
+
+			/* [-] and [+] just zero the cell */
+			if (n - start == 2 && code[start + 1].op == BF_ADD &&
+			    (code[start + 1].arg == 1 ||
+				code[start + 1].arg == -1)) {
+				n = start;
+				code[n++] = (struct bf_insn) { BF_SET, 0 };
+				break;
+			}
+
+			code[start].arg = n;
+			code[n++] = (struct bf_insn) { BF_END_LOOP, start };
+			break;
+		case '\n':
+			line++;
+			col = 0;
+			break;
+		case ' ':
+		case '\t':
+			break;
+		default:
+			snprintf(err, err_sz, "%d:%d: bad character '%c'", line,
+			    col, *prog);
+			goto fail;
+		}
+	}
+
+	if (depth) {
+		snprintf(err, err_sz, "%d:%d: unmatched '['",
+		    line_stack[depth - 1], col_stack[depth - 1]);
+		goto fail;
+	}
+
+	code[n] = (struct bf_insn) { BF_HALT, 0 };
+	free(loop_stack);
+	free(line_stack);
+	free(col_stack);
+
+	if (trace)
+		bf_print(code);
+
+	return code;
+
+fail:
+	free(code);
+	free(loop_stack);
+	free(line_stack);
+	free(col_stack);
+	return NULL;
+}
+
+/* like bf_try_compile() but give up on errors */
+struct bf_insn *
+bf_compile(char *prog, bool trace)
+{
+	char err[128];
+	struct bf_insn *code = bf_try_compile(prog, trace, err, sizeof(err));
+
+	if (!code) {
+		fprintf(stderr, "bf: %s\n", err);
+		abort();
+	}
+	return code;
+}
+
+/*
+ * Whether the loop starting at start always finishes within 256 iterations on
+ * 8-bit cells: it only adds to cells, returns to where it started and steps the
+ * loop cell by an odd amount, like [->+<]. llvm turns these into straight-line
+ * code.
+ */
+bool
+bf_loop_counted(struct bf_insn *code, int start)
+{
+	int pos = 0;
+	int delta = 0;
+
+	for (int i = start + 1; i < code[start].arg; i++) {
+		switch (code[i].op) {
+		case BF_ADD:
+			if (pos == 0)
+				delta += code[i].arg;
+			break;
+		case BF_MOVE:
+			pos += code[i].arg;
+			break;
+		case BF_MULTI:
+			for (int j = 1; j <= code[i].arg; j++) {
+				if (code[i + j].op != BF_ADD)
+					return false;
+				if (pos + j - 1 == 0)
+					delta += code[i + j].arg;
+			}
+			i += code[i].arg;
+			break;
+		default:
+			return false;
+		}
+	}
+
+	return pos == 0 && (delta & 1);
+}
+
+/*
+ * Whether the loop starting at start is counted, or a scan like [>>>>] or
+ * [>[->+<]<<]: every iteration moves the head by the same non-zero amount, so
+ * it finishes within BF_MEM_SZ iterations or leaves the tape, which the jits
+ * do not check anyway. The jits do not charge fuel for these.
+ */
+bool
+bf_loop_bounded(struct bf_insn *code, int start)
+{
+	int pos = 0;
+
+	if (bf_loop_counted(code, start))
+		return true;
+
+	for (int i = start + 1; i < code[start].arg; i++) {
+		switch (code[i].op) {
+		case BF_MOVE:
+			pos += code[i].arg;
+			break;
+		case BF_MULTI:
+			i += code[i].arg;
+			break;
+		case BF_LOOP:
+			/* comes back to where it started */
+			if (!bf_loop_counted(code, i))
+				return false;
+			i = code[i].arg;
+			break;
+		case BF_ADD:
+		case BF_SET:
+		case BF_OUT:
+		case BF_PUTC:
+		case BF_IN:
+			break;
+		default:
+			return false;
+		}
+	}
+
+	return pos != 0;
+}
+
+const char *
+bf_op_name(enum bf_op op)
+{
+	static const char *const names[] = {
+		[BF_ADD] = "add",
+		[BF_MOVE] = "move",
+		[BF_SET] = "set",
+		[BF_OUT] = "out",
+		[BF_PUTC] = "putc",
+		[BF_IN] = "in",
+		[BF_LOOP] = "loop",
+		[BF_END_LOOP] = "end_loop",
+		[BF_MULTI] = "multi",
+		[BF_NOP] = "nop",
+		[BF_HALT] = "halt",
+	};
+
+	return names[op];
+}
+
+void
+bf_print(struct bf_insn *code)
+{
+	for (int i = 0;; i++) {
+		printf("bytecode: %4d %-8s %d\n", i, bf_op_name(code[i].op),
+		    code[i].arg);
+		if (code[i].op == BF_HALT)
+			break;
+	}
+}
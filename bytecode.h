@@ -0,0 +1,78 @@
+/*
+ * Copyright 2021 ETH Zurich
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Author: Robert Balas (balasr@iis.ee.ethz.ch)
+ */
+
+/*
+ * Folded representation of a brainf*ck program. Runs of '+'/'-' and '<'/'>'
+ * are merged into a single instruction, "[-]" becomes a store of zero and
+ * loops carry the index of their matching bracket. The program is terminated
+ * by BF_HALT.
+ */
+enum bf_op {
+	BF_ADD,	     /* *h += arg */
+	BF_MOVE,     /* h += arg */
+	BF_SET,	     /* *h = arg */
+	BF_OUT,	     /* putchar(*h) */
+	BF_PUTC,     /* putchar(arg) */
+	BF_IN,	     /* *h = getchar() */
+	BF_LOOP,     /* if (!*h) goto arg */
+	BF_END_LOOP, /* if (*h) goto arg */
+	BF_MULTI,    /* h[i] += or = the arg BF_ADD/BF_SET slots that follow */
+	BF_NOP,	     /* only used inside the optimizer */
+	BF_HALT,
+};
+
+struct bf_insn {
+	enum bf_op op;
+	int arg;
+};
+
+/* widest window a BF_MULTI updates */
+#define BF_MULTI_MAX 32
+
+/* tape size of the jits, in cells */
+#define BF_MEM_SZ (64 * 1024)
+
+/*
+ * How a run ended. With fuel, every loop iteration costs the size of its body
+ * and a run stops with BF_OUT_OF_FUEL once the budget drops below zero. The
+ * jits skip the loops bf_loop_bounded() accepts, the interpreter charges all
+ * of them, so the same budget runs out at different points in each engine.
+ */
+enum bf_status {
+	BF_DONE,
+	BF_OUT_OF_FUEL,
+};
+
+/*
+ * Interface of jitted code. It runs on a caller provided, zeroed tape starting
+ * at *head. With fuel metering every unbounded loop iteration costs the size
+ * of its body, charged at the back-edge, and the program stops with
+ * BF_OUT_OF_FUEL once *fuel drops below zero. *head and *fuel are updated on
+ * return, so the caller can inspect where the program stopped. Without
+ * metering fuel is never touched and may be NULL.
+ */
+typedef int (*bf_jitted_fn)(uint8_t *mem, int32_t *head, int64_t *fuel);
+
+struct bf_insn *bf_try_compile(
+    char *prog, bool trace, char *err, size_t err_sz);
+struct bf_insn *bf_compile(char *prog, bool trace);
+bool bf_loop_counted(struct bf_insn *code, int start);
+bool bf_loop_bounded(struct bf_insn *code, int start);
+const char *bf_op_name(enum bf_op op);
+void bf_print(struct bf_insn *code);
@@ -18,10 +18,15 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "bytecode.h"
 #include "interpreter.h"
+#include "optimize.h"
+#include "tape.h"
+#include "trace.h"
 /*
  * The BrainF language has 8 commands:
  * Command   Equivalent C    Action
@@ -38,105 +43,104 @@
 
 #define TAPE_SZ (64 * 1024)
 
-void
-interpret(char *prog, bool trace)
+/* run prog, recording loop events into trace if it is not NULL. If fuel is
+ * not NULL every loop iteration costs the size of its body and we stop once
+ * the budget drops below zero. Unlike the jits we also charge the loops
+ * bf_loop_bounded() accepts: with int cells and a checked tape they are not
+ * bounded here. */
+enum bf_status
+interpret(char *prog, struct bf_trace *trace, int64_t *fuel)
 {
-	int tape[TAPE_SZ] = { 0 };
-	int nesting = 0; /* nesting counter */
-	int head = 0;	 /* tape pointer */
+	enum bf_status status = BF_DONE;
+	struct bf_tape *t = tape_get(TAPE_SZ * sizeof(int));
+	int *tape = t->mem;
+	int head = 0; /* tape pointer */
+	int hi = 0;   /* rightmost cell we visited */
 
-	char *const beg = prog;
+	struct bf_insn *code = bf_compile(prog, false);
+	bf_optimize(code, false);
 
-	while (*prog) {
-
-		if (trace)
-			printf("bf: pc=%p head=%d, executing '%c'\n", prog,
-			    head, *prog);
+	if (trace)
+		trace_bind(trace, code);
 
-		switch (*prog) {
-		case ',':
+	for (struct bf_insn *pc = code; pc->op != BF_HALT; pc++) {
+		switch (pc->op) {
+		case BF_IN:
 			tape[head] = getchar();
-			prog++;
 			break;
-		case '.':
+		case BF_OUT:
 			putchar(tape[head]);
-			prog++;
 			break;
-		case '-':
-			--tape[head];
-			prog++;
+		case BF_PUTC:
+			putchar(pc->arg);
 			break;
-		case '+':
-			++tape[head];
-			prog++;
+		case BF_ADD:
+			tape[head] += pc->arg;
 			break;
-		case '<':
-			if (head == 0) {
+		case BF_SET:
+			tape[head] = pc->arg;
+			break;
+		case BF_MOVE:
+			head += pc->arg;
+			if (head < 0) {
 				fprintf(stderr, "bf: tape underflow\n");
 				abort();
 			}
-			--head;
-			prog++;
-			break;
-		case '>':
-			++head;
 			if (head >= TAPE_SZ) {
 				fprintf(stderr, "bf: tape overflow\n");
 				abort();
 			}
-			prog++;
+			if (head > hi)
+				hi = head;
 			break;
-		case '[':
-			if (tape[head]) {
-				prog++;
-				break;
-			}
-
-			/* jump after matching ] */
-			nesting = 1;
-			while (nesting && *++prog) {
-				if (*prog == ']')
-					nesting--;
-				else if (*prog == '[')
-					nesting++;
-			}
-			/* we should now be at the matching bracket */
-			if (nesting) {
-				fprintf(stderr, "bf: unmatched '['\n");
+		case BF_MULTI:
+			if (head + pc->arg > TAPE_SZ) {
+				fprintf(stderr, "bf: tape overflow\n");
 				abort();
 			}
-			prog++;
+			if (head + pc->arg - 1 > hi)
+				hi = head + pc->arg - 1;
+			for (int i = 0; i < pc->arg; i++) {
+				if (pc[1 + i].op == BF_SET)
+					tape[head + i] = pc[1 + i].arg;
+				else
+					tape[head + i] += pc[1 + i].arg;
+			}
+			pc += pc->arg;
+			break;
+		case BF_LOOP:
+			if (trace)
+				trace_event(trace, pc - code, head, tape[head],
+				    BF_LOOP);
+			/* jump to matching ], we step past it below */
+			if (!tape[head])
+				pc = &code[pc->arg];
 			break;
-		case ']':
-			if (!tape[head]) {
-				prog++;
-				break;
+		case BF_END_LOOP:
+			if (fuel) {
+				*fuel -= pc - code - pc->arg;
+				if (*fuel < 0) {
+					status = BF_OUT_OF_FUEL;
+					goto out;
+				}
 			}
+			if (trace)
+				trace_event(trace, pc->arg, head, tape[head],
+				    BF_END_LOOP);
 			/* jump (backwards) to matching [ */
-			nesting = 1;
-			while (nesting && --prog >= beg) {
-				if (*prog == '[')
-					nesting--;
-				else if (*prog == ']')
-					nesting++;
-			}
-			if (nesting) {
-				fprintf(stderr, "bf: unmatched ']'\n");
-				abort();
-			}
-			prog++;
-			break;
-		case ' ':
-		case '\n':
-		case '\t':
-			prog++;
+			if (tape[head])
+				pc = &code[pc->arg];
 			break;
 		default:
-			fprintf(stderr, "bf: bad character '%c'\n", *prog);
+			fprintf(stderr, "bf: bad opcode %d\n", pc->op);
 			abort();
 			break;
 		}
 	}
-	if (trace)
-		puts("bf: interpreter done");
+
+out:
+	t->used = (hi + 1) * sizeof(int);
+	tape_put(t);
+	free(code);
+	return status;
 }
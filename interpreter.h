@@ -17,4 +17,7 @@
  * Author: Robert Balas (balasr@iis.ee.ethz.ch)
  */
 
-void interpret(char *prog, bool trace);
+struct bf_trace;
+
+enum bf_status interpret(
+    char *prog, struct bf_trace *trace, int64_t *fuel);
@@ -0,0 +1,711 @@
+/*
+ * Copyright 2021 ETH Zurich
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Author: Robert Balas (balasr@iis.ee.ethz.ch)
+ */
+
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/Transforms/PassManagerBuilder.h>
+#include <llvm-c/Types.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "lower.h"
+#include "trace.h"
+
+void
+print_bb(LLVMValueRef fun)
+{
+	LLVMBasicBlockRef bb = NULL;
+	for (bb = LLVMGetFirstBasicBlock(fun); bb;
+	     bb = LLVMGetNextBasicBlock(bb)) {
+		printf("bb: %s\n", LLVMGetBasicBlockName(bb));
+		if (LLVMGetBasicBlockTerminator(bb))
+			puts("ok ");
+		else
+			puts("NO TERMINATOR");
+
+		LLVMValueRef insn = NULL;
+		for (insn = LLVMGetFirstInstruction(bb); insn;
+		     insn = LLVMGetNextInstruction(insn)) {
+			printf("insn: %d\n", LLVMGetInstructionOpcode(insn));
+		}
+	}
+}
+
+/* tell llvm that the true branch of br is almost never taken */
+void
+lower_unlikely(LLVMContextRef ctx, LLVMValueRef br)
+{
+	LLVMValueRef weights[] = {
+		LLVMMDStringInContext(ctx, "branch_weights", 14),
+		LLVMConstInt(LLVMInt32TypeInContext(ctx), 1, false),
+		LLVMConstInt(LLVMInt32TypeInContext(ctx), 1 << 20, false),
+	};
+	LLVMSetMetadata(br, LLVMGetMDKindIDInContext(ctx, "prof", 4),
+	    LLVMMDNodeInContext(ctx, weights, 3));
+}
+
+#if defined(__x86_64__) && defined(__ELF__)
+#define LOWER_TRACE_ASM
+
+/* slow path of a trace event, called through lower_trace_thunk */
+void
+lower_trace_sample(uint32_t *countdown, int pc, int op, int head, int val)
+{
+	struct bf_trace *t = (struct bf_trace *)((char *)countdown -
+	    offsetof(struct bf_trace, countdown));
+
+	t->countdown = t->hdr->sample;
+	trace_record(t, pc, head, val, op);
+}
+
+/*
+ * The asm statement at a trace site pushes the countdown, pc, op, head and
+ * cell and calls this thunk. It preserves every register, so the statement
+ * does not have to clobber any, and realigns the stack for the call into C.
+ */
+void lower_trace_thunk(void);
+__asm__(".text\n"
+	".globl lower_trace_thunk\n"
+	".hidden lower_trace_thunk\n"
+	".type lower_trace_thunk, @function\n"
+	"lower_trace_thunk:\n"
+	"	pushq %rbp\n"
+	"	movq %rsp, %rbp\n"
+	"	pushq %rax\n"
+	"	pushq %rcx\n"
+	"	pushq %rdx\n"
+	"	pushq %rsi\n"
+	"	pushq %rdi\n"
+	"	pushq %r8\n"
+	"	pushq %r9\n"
+	"	pushq %r10\n"
+	"	pushq %r11\n"
+	"	andq $-16, %rsp\n"
+	"	subq $256, %rsp\n"
+	"	movups %xmm0, 0(%rsp)\n"
+	"	movups %xmm1, 16(%rsp)\n"
+	"	movups %xmm2, 32(%rsp)\n"
+	"	movups %xmm3, 48(%rsp)\n"
+	"	movups %xmm4, 64(%rsp)\n"
+	"	movups %xmm5, 80(%rsp)\n"
+	"	movups %xmm6, 96(%rsp)\n"
+	"	movups %xmm7, 112(%rsp)\n"
+	"	movups %xmm8, 128(%rsp)\n"
+	"	movups %xmm9, 144(%rsp)\n"
+	"	movups %xmm10, 160(%rsp)\n"
+	"	movups %xmm11, 176(%rsp)\n"
+	"	movups %xmm12, 192(%rsp)\n"
+	"	movups %xmm13, 208(%rsp)\n"
+	"	movups %xmm14, 224(%rsp)\n"
+	"	movups %xmm15, 240(%rsp)\n"
+	"	movq 48(%rbp), %rdi\n"
+	"	movl 40(%rbp), %esi\n"
+	"	movl 32(%rbp), %edx\n"
+	"	movl 24(%rbp), %ecx\n"
+	"	movl 16(%rbp), %r8d\n"
+	"	call lower_trace_sample@PLT\n"
+	"	movups 0(%rsp), %xmm0\n"
+	"	movups 16(%rsp), %xmm1\n"
+	"	movups 32(%rsp), %xmm2\n"
+	"	movups 48(%rsp), %xmm3\n"
+	"	movups 64(%rsp), %xmm4\n"
+	"	movups 80(%rsp), %xmm5\n"
+	"	movups 96(%rsp), %xmm6\n"
+	"	movups 112(%rsp), %xmm7\n"
+	"	movups 128(%rsp), %xmm8\n"
+	"	movups 144(%rsp), %xmm9\n"
+	"	movups 160(%rsp), %xmm10\n"
+	"	movups 176(%rsp), %xmm11\n"
+	"	movups 192(%rsp), %xmm12\n"
+	"	movups 208(%rsp), %xmm13\n"
+	"	movups 224(%rsp), %xmm14\n"
+	"	movups 240(%rsp), %xmm15\n"
+	"	leaq -72(%rbp), %rsp\n"
+	"	popq %r11\n"
+	"	popq %r10\n"
+	"	popq %r9\n"
+	"	popq %r8\n"
+	"	popq %rdi\n"
+	"	popq %rsi\n"
+	"	popq %rdx\n"
+	"	popq %rcx\n"
+	"	popq %rax\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size lower_trace_thunk, .-lower_trace_thunk\n");
+
+/* operands: countdown, head, cell and the thunk */
+static const char trace_asm[] = "decl ($0)\n\t"
+				"jnz 1f\n\t"
+				"pushq $0\n\t"
+				"pushq $$%d\n\t"
+				"pushq $$%d\n\t"
+				"pushq ${1:q}\n\t"
+				"pushq ${2:q}\n\t"
+				"callq *$3\n\t"
+				"addq $$40, %%rsp\n"
+				"1:";
+#endif
+
+/* record an event for the loop starting at pc every sample'th time, counting
+ * down in trace->countdown. On x86-64 the whole event is a single asm
+ * statement: a branch and a call per loop test gives -O2 so many extra blocks
+ * that compiling a traced program took more than twice as long. */
+void
+lower_trace(LLVMBuilderRef builder, LLVMContextRef ctx, LLVMValueRef fun,
+    struct bf_trace *trace, int pc, LLVMValueRef offset, LLVMValueRef load_ele,
+    enum bf_op op)
+{
+	LLVMValueRef val = LLVMBuildIntCast2(builder, load_ele,
+	    LLVMInt32TypeInContext(ctx), false, "cast_char2int");
+
+#if defined(LOWER_TRACE_ASM)
+	char code[sizeof(trace_asm) + 2 * 12];
+	snprintf(code, sizeof(code), trace_asm, pc, op);
+
+	LLVMTypeRef asm_args[] = {
+		LLVMPointerType(LLVMInt32TypeInContext(ctx), 0),
+		LLVMInt32TypeInContext(ctx),
+		LLVMInt32TypeInContext(ctx),
+		LLVMPointerType(LLVMInt8TypeInContext(ctx), 0),
+	};
+	LLVMTypeRef asm_type = LLVMFunctionType(
+	    LLVMVoidTypeInContext(ctx), asm_args, 4, false);
+	LLVMValueRef asm_fun = LLVMGetInlineAsm(asm_type, code, strlen(code),
+	    "r,r,r,r,~{dirflag},~{fpsr},~{flags}", 35, true, false,
+	    LLVMInlineAsmDialectATT, false);
+	LLVMValueRef call_args[] = {
+		LLVMConstIntToPtr(LLVMConstInt(LLVMInt64TypeInContext(ctx),
+				      (uintptr_t)&trace->countdown, false),
+		    asm_args[0]),
+		offset,
+		val,
+		LLVMConstIntToPtr(LLVMConstInt(LLVMInt64TypeInContext(ctx),
+				      (uintptr_t)&lower_trace_thunk, false),
+		    asm_args[3]),
+	};
+	LLVMValueRef call = LLVMBuildCall2(
+	    builder, asm_type, asm_fun, call_args, 4, "");
+	/* the tape is safe, only the trace is written */
+	LLVMAddCallSiteAttribute(call, LLVMAttributeFunctionIndex,
+	    LLVMCreateEnumAttribute(ctx,
+		LLVMGetEnumAttributeKindForName("inaccessiblememonly", 19),
+		0));
+	(void)fun;
+#else
+	/* jitted code lives in our process, so we can call through a plain
+	 * function pointer and pass the trace as a constant */
+	LLVMTypeRef trace_args[] = {
+		LLVMPointerType(LLVMInt8TypeInContext(ctx), 0),
+		LLVMInt32TypeInContext(ctx),
+		LLVMInt32TypeInContext(ctx),
+		LLVMInt32TypeInContext(ctx),
+		LLVMInt32TypeInContext(ctx),
+	};
+	LLVMTypeRef trace_type = LLVMFunctionType(
+	    LLVMVoidTypeInContext(ctx), trace_args, 5, false);
+	LLVMValueRef trace_fun = LLVMConstIntToPtr(
+	    LLVMConstInt(LLVMInt64TypeInContext(ctx),
+		(uintptr_t)&trace_record, false),
+	    LLVMPointerType(trace_type, 0));
+	LLVMValueRef countdown = LLVMConstIntToPtr(
+	    LLVMConstInt(LLVMInt64TypeInContext(ctx),
+		(uintptr_t)&trace->countdown, false),
+	    LLVMPointerType(LLVMInt32TypeInContext(ctx), 0));
+
+	LLVMValueRef load = LLVMBuildLoad2(
+	    builder, LLVMInt32TypeInContext(ctx), countdown, "countdown");
+	LLVMValueRef decr = LLVMBuildSub(builder, load,
+	    LLVMConstInt(LLVMInt32TypeInContext(ctx), 1, false), "decr");
+	LLVMBuildStore(builder, decr, countdown);
+	LLVMValueRef cmp = LLVMBuildICmp(builder, LLVMIntEQ, decr,
+	    LLVMConstInt(LLVMInt32TypeInContext(ctx), 0, false), "cmp_sample");
+
+	LLVMBasicBlockRef trace_bb = LLVMAppendBasicBlockInContext(
+	    ctx, fun, "trace");
+	LLVMBasicBlockRef cont_bb = LLVMAppendBasicBlockInContext(
+	    ctx, fun, "trace_cont");
+	lower_unlikely(ctx, LLVMBuildCondBr(builder, cmp, trace_bb, cont_bb));
+	LLVMPositionBuilderAtEnd(builder, trace_bb);
+
+	LLVMValueRef call_args[] = {
+		LLVMConstIntToPtr(LLVMConstInt(LLVMInt64TypeInContext(ctx),
+				      (uintptr_t)trace, false),
+		    trace_args[0]),
+		LLVMConstInt(LLVMInt32TypeInContext(ctx), pc, false),
+		offset,
+		val,
+		LLVMConstInt(LLVMInt32TypeInContext(ctx), op, false),
+	};
+	LLVMValueRef call = LLVMBuildCall2(
+	    builder, trace_type, trace_fun, call_args, 5, "");
+	/* keep the sampled path out of the way of the hot loop */
+	LLVMAddCallSiteAttribute(call, LLVMAttributeFunctionIndex,
+	    LLVMCreateEnumAttribute(ctx,
+		LLVMGetEnumAttributeKindForName("cold", 4), 0));
+	LLVMBuildStore(builder,
+	    LLVMConstInt(LLVMInt32TypeInContext(ctx), trace->hdr->sample,
+		false),
+	    countdown);
+	LLVMBuildBr(builder, cont_bb);
+
+	LLVMPositionBuilderAtEnd(builder, cont_bb);
+#endif
+}
+
+/* store head and fuel back for the caller and return status */
+void
+lower_exit(LLVMBuilderRef builder, LLVMContextRef ctx, LLVMValueRef fun,
+    LLVMValueRef tape_ptr, LLVMValueRef fuel, enum bf_status status)
+{
+	LLVMValueRef load = LLVMBuildLoad2(
+	    builder, LLVMInt32TypeInContext(ctx), tape_ptr, "load");
+	LLVMBuildStore(builder, load, LLVMGetParam(fun, 1));
+
+	if (fuel) {
+		load = LLVMBuildLoad2(
+		    builder, LLVMInt64TypeInContext(ctx), fuel, "load");
+		LLVMBuildStore(builder, load, LLVMGetParam(fun, 2));
+	}
+
+	LLVMBuildRet(
+	    builder, LLVMConstInt(LLVMInt32TypeInContext(ctx), status, false));
+}
+
+/* lower brainfuck bytecode to llvm, instrumenting loops if trace is not NULL
+ * and charging fuel at back-edges if metered. The result is a bf_jitted_fn. */
+LLVMValueRef
+lower(struct bf_insn *code, LLVMModuleRef mod, LLVMContextRef ctx,
+    const char *name, struct bf_trace *trace, bool metered, bool verbose)
+{
+	struct bf_insn *const beg = code;
+
+	/* loop and exit block of every open [ */
+	int n = 0;
+	while (code[n].op != BF_HALT)
+		n++;
+	LLVMBasicBlockRef *bb_stack = malloc((2 * n + 2) * sizeof(*bb_stack));
+	if (!bb_stack) {
+		perror("malloc");
+		abort();
+	}
+
+	if (trace)
+		trace_bind(trace, code);
+
+	/* link putchar() and getchar() externally */
+	LLVMTypeRef putchar_args[] = { LLVMInt32TypeInContext(ctx) };
+	LLVMTypeRef getchar_args[] = {};
+
+	LLVMTypeRef putchar_type = LLVMFunctionType(
+	    LLVMInt32TypeInContext(ctx), putchar_args, 1, false);
+	LLVMTypeRef getchar_type = LLVMFunctionType(
+	    LLVMInt32TypeInContext(ctx), getchar_args, 0, false);
+
+	LLVMValueRef putchar_fun = LLVMAddFunction(
+	    mod, "putchar", putchar_type);
+	LLVMValueRef getchar_fun = LLVMAddFunction(
+	    mod, "getchar", getchar_type);
+
+	LLVMSetLinkage(putchar_fun, LLVMExternalLinkage);
+	LLVMSetLinkage(getchar_fun, LLVMExternalLinkage);
+
+	/* add jitted function */
+	LLVMTypeRef jitted_args[] = {
+		LLVMPointerType(LLVMInt8TypeInContext(ctx), 0),
+		LLVMPointerType(LLVMInt32TypeInContext(ctx), 0),
+		LLVMPointerType(LLVMInt64TypeInContext(ctx), 0),
+	};
+	LLVMTypeRef jitted_type = LLVMFunctionType(
+	    LLVMInt32TypeInContext(ctx), jitted_args, 3, false);
+	LLVMValueRef jitted_fun = LLVMAddFunction(mod, name, jitted_type);
+
+	LLVMSetLinkage(jitted_fun, LLVMExternalLinkage);
+
+	LLVMBasicBlockRef entry_bb = LLVMAppendBasicBlockInContext(
+	    ctx, jitted_fun, "entry");
+
+	LLVMBuilderRef builder = LLVMCreateBuilderInContext(ctx);
+	LLVMPositionBuilderAtEnd(builder, entry_bb);
+
+	/* the caller hands us the (zeroed) tape */
+	LLVMValueRef mem = LLVMGetParam(jitted_fun, 0);
+
+	/* tape pointer, init to where the caller wants us to start */
+	LLVMValueRef tape_ptr = LLVMBuildAlloca(
+	    builder, LLVMInt32TypeInContext(ctx), "tape_ptr");
+	LLVMBuildStore(builder,
+	    LLVMBuildLoad2(builder, LLVMInt32TypeInContext(ctx),
+		LLVMGetParam(jitted_fun, 1), "head"),
+	    tape_ptr);
+
+	/* remaining fuel, we leave through fuel_out_bb once it is negative */
+	LLVMValueRef fuel = NULL;
+	LLVMBasicBlockRef fuel_out_bb = NULL;
+	if (metered) {
+		fuel = LLVMBuildAlloca(
+		    builder, LLVMInt64TypeInContext(ctx), "fuel");
+		LLVMBuildStore(builder,
+		    LLVMBuildLoad2(builder, LLVMInt64TypeInContext(ctx),
+			LLVMGetParam(jitted_fun, 2), "fuel"),
+		    fuel);
+		fuel_out_bb = LLVMAppendBasicBlockInContext(
+		    ctx, jitted_fun, "fuel_out");
+	}
+
+#if defined(LOWER_TRACE_ASM)
+	/* trace events call out from the middle of an asm statement, so they
+	 * must not land in the red zone */
+	if (trace)
+		LLVMAddAttributeAtIndex(jitted_fun,
+		    LLVMAttributeFunctionIndex,
+		    LLVMCreateEnumAttribute(ctx,
+			LLVMGetEnumAttributeKindForName("noredzone", 9), 0));
+#endif
+
+	int bb_index = 0;
+	/* end of the innermost loop llvm can compute in closed form */
+	int bounded_end = -1;
+
+	for (; code->op != BF_HALT; code++) {
+		LLVMValueRef gep_args[1] = { 0 };
+		LLVMValueRef call_args[1] = { 0 };
+		LLVMValueRef load, move, decr;
+		LLVMValueRef ele_ptr, load_ele, add_ele;
+		LLVMValueRef cast, offset;
+		LLVMValueRef user;
+		LLVMValueRef cmp, br;
+		LLVMValueRef keep[BF_MULTI_MAX], delta[BF_MULTI_MAX];
+		LLVMTypeRef vec_type;
+
+		LLVMBasicBlockRef loop_bb = NULL;
+		LLVMBasicBlockRef exit_bb = NULL;
+		LLVMBasicBlockRef fueled_bb = NULL;
+
+		switch (code->op) {
+		case BF_IN:
+			/* getchar */
+			call_args[0] = 0;
+			user = LLVMBuildCall(
+			    builder, getchar_fun, call_args, 0, "call_comma");
+			cast = LLVMBuildIntCast2(builder, user,
+			    LLVMInt8TypeInContext(ctx), false, "cast_int2char");
+			offset = LLVMBuildLoad2(builder,
+			    LLVMInt32TypeInContext(ctx), tape_ptr, "offset");
+			gep_args[0] = offset;
+			ele_ptr = LLVMBuildInBoundsGEP2(builder,
+			    LLVMInt8TypeInContext(ctx), mem, gep_args, 1,
+			    "ele_ptr");
+			LLVMBuildStore(builder, cast, ele_ptr);
+			break;
+
+		case BF_OUT:
+			/* putchar. Note we need to cast char to int */
+			offset = LLVMBuildLoad2(builder,
+			    LLVMInt32TypeInContext(ctx), tape_ptr, "offset");
+			gep_args[0] = offset;
+			ele_ptr = LLVMBuildInBoundsGEP2(builder,
+			    LLVMInt8TypeInContext(ctx), mem, gep_args, 1,
+			    "ele_ptr");
+			load_ele = LLVMBuildLoad2(builder,
+			    LLVMInt8TypeInContext(ctx), ele_ptr, "load_ele");
+			cast = LLVMBuildIntCast2(builder, load_ele,
+			    LLVMInt32TypeInContext(ctx), false,
+			    "cast_char2int");
+			call_args[0] = cast;
+			LLVMBuildCall(
+			    builder, putchar_fun, call_args, 1, "call_dot");
+			break;
+
+		case BF_PUTC:
+			/* putchar of a value the optimizer figured out */
+			call_args[0] = LLVMConstInt(LLVMInt32TypeInContext(ctx),
+			    code->arg, true);
+			LLVMBuildCall(
+			    builder, putchar_fun, call_args, 1, "call_dot");
+			break;
+
+		case BF_ADD:
+			offset = LLVMBuildLoad2(builder,
+			    LLVMInt32TypeInContext(ctx), tape_ptr, "offset");
+			gep_args[0] = offset;
+			ele_ptr = LLVMBuildInBoundsGEP2(builder,
+			    LLVMInt8TypeInContext(ctx), mem, gep_args, 1,
+			    "ele_ptr");
+			load_ele = LLVMBuildLoad2(builder,
+			    LLVMInt8TypeInContext(ctx), ele_ptr, "load_ele");
+			add_ele = LLVMBuildAdd(builder, load_ele,
+			    LLVMConstInt(LLVMInt8TypeInContext(ctx), code->arg,
+				true),
+			    "add_ele");
+			LLVMBuildStore(builder, add_ele, ele_ptr);
+			break;
+
+		case BF_SET:
+			offset = LLVMBuildLoad2(builder,
+			    LLVMInt32TypeInContext(ctx), tape_ptr, "offset");
+			gep_args[0] = offset;
+			ele_ptr = LLVMBuildInBoundsGEP2(builder,
+			    LLVMInt8TypeInContext(ctx), mem, gep_args, 1,
+			    "ele_ptr");
+			LLVMBuildStore(builder,
+			    LLVMConstInt(LLVMInt8TypeInContext(ctx), code->arg,
+				true),
+			    ele_ptr);
+			break;
+
+		case BF_MULTI:
+			offset = LLVMBuildLoad2(builder,
+			    LLVMInt32TypeInContext(ctx), tape_ptr, "offset");
+
+			/* keep cells scalar in bounded loops, llvm replaces
+			 * those with a multiplication but not when they are
+			 * vectors */
+			if (code - beg < bounded_end) {
+				for (int i = 0; i < code->arg; i++) {
+					struct bf_insn *slot = &code[1 + i];
+					if (slot->op == BF_ADD && !slot->arg)
+						continue;
+					gep_args[0] = LLVMBuildAdd(builder,
+					    offset,
+					    LLVMConstInt(
+						LLVMInt32TypeInContext(ctx), i,
+						false),
+					    "cell");
+					ele_ptr = LLVMBuildInBoundsGEP2(builder,
+					    LLVMInt8TypeInContext(ctx), mem,
+					    gep_args, 1, "ele_ptr");
+					add_ele = LLVMConstInt(
+					    LLVMInt8TypeInContext(ctx),
+					    slot->arg, true);
+					if (slot->op == BF_ADD) {
+						load_ele = LLVMBuildLoad2(
+						    builder,
+						    LLVMInt8TypeInContext(ctx),
+						    ele_ptr, "load_ele");
+						add_ele = LLVMBuildAdd(builder,
+						    load_ele, add_ele,
+						    "add_ele");
+					}
+					LLVMBuildStore(
+					    builder, add_ele, ele_ptr);
+				}
+				code += code->arg;
+				break;
+			}
+
+			/* a single vector update of the window at the head */
+			for (int i = 0; i < code->arg; i++) {
+				struct bf_insn *slot = &code[1 + i];
+				keep[i] = LLVMConstInt(LLVMInt8TypeInContext(ctx),
+				    slot->op == BF_SET ? 0 : 0xff, false);
+				delta[i] = LLVMConstInt(
+				    LLVMInt8TypeInContext(ctx), slot->arg, true);
+			}
+			vec_type = LLVMVectorType(
+			    LLVMInt8TypeInContext(ctx), code->arg);
+			gep_args[0] = offset;
+			ele_ptr = LLVMBuildInBoundsGEP2(builder,
+			    LLVMInt8TypeInContext(ctx), mem, gep_args, 1,
+			    "ele_ptr");
+			cast = LLVMBuildBitCast(builder, ele_ptr,
+			    LLVMPointerType(vec_type, 0), "vec_ptr");
+			load_ele = LLVMBuildLoad2(
+			    builder, vec_type, cast, "load_vec");
+			LLVMSetAlignment(load_ele, 1);
+			add_ele = LLVMBuildAnd(builder, load_ele,
+			    LLVMConstVector(keep, code->arg), "keep_vec");
+			add_ele = LLVMBuildAdd(builder, add_ele,
+			    LLVMConstVector(delta, code->arg), "add_vec");
+			LLVMSetAlignment(
+			    LLVMBuildStore(builder, add_ele, cast), 1);
+			code += code->arg;
+			break;
+
+		case BF_MOVE:
+			/* move tape pointer */
+			load = LLVMBuildLoad2(builder,
+			    LLVMInt32TypeInContext(ctx), tape_ptr, "load");
+			move = LLVMBuildAdd(builder, load,
+			    LLVMConstInt(LLVMInt32TypeInContext(ctx), code->arg,
+				true),
+			    "move");
+			LLVMBuildStore(builder, move, tape_ptr);
+			break;
+
+		case BF_LOOP:
+			if (bf_loop_counted(beg, code - beg))
+				bounded_end = code->arg;
+
+			/* load value under tape_ptr */
+			offset = LLVMBuildLoad2(builder,
+			    LLVMInt32TypeInContext(ctx), tape_ptr, "offset");
+			gep_args[0] = offset;
+			ele_ptr = LLVMBuildInBoundsGEP2(builder,
+			    LLVMInt8TypeInContext(ctx), mem, gep_args, 1,
+			    "ele_ptr");
+			load_ele = LLVMBuildLoad2(builder,
+			    LLVMInt8TypeInContext(ctx), ele_ptr, "load_ele");
+
+			if (trace && trace_wants(trace, code - beg))
+				lower_trace(builder, ctx, jitted_fun, trace,
+				    code - beg, offset, load_ele, BF_LOOP);
+
+			/* branch depending whether it's zero or not */
+			cmp = LLVMBuildICmp(builder, LLVMIntEQ, load_ele,
+			    LLVMConstInt(LLVMInt8TypeInContext(ctx), 0, false),
+			    "cmp_zero");
+
+			/* creat loop body block and skip block */
+			loop_bb = LLVMAppendBasicBlockInContext(
+			    ctx, jitted_fun, "loop_body");
+			exit_bb = LLVMAppendBasicBlockInContext(
+			    ctx, jitted_fun, "loop_exit");
+
+			/* if cmp is zero, then exit loop, else loop */
+			LLVMBuildCondBr(builder, cmp, exit_bb, loop_bb);
+
+			/* push loop and exit to stack for nesting  of [ */
+			bb_stack[bb_index++] = loop_bb;
+			bb_stack[bb_index++] = exit_bb;
+
+			/* continue inserting bb's to loop body */
+			LLVMPositionBuilderAtEnd(builder, loop_bb);
+			break;
+
+		case BF_END_LOOP:
+			if (bb_index == 0) {
+				fprintf(stderr, "bf: unmatched closing ']'\n");
+				abort();
+			} else if (bb_index < 2) {
+				fprintf(stderr,
+				    "bf: basic block stack underflow\n");
+				abort();
+			}
+
+			/* pop from stack */
+			exit_bb = bb_stack[--bb_index];
+			loop_bb = bb_stack[--bb_index];
+
+			/* charge a whole iteration at once, before the test */
+			if (metered && !bf_loop_bounded(beg, code->arg)) {
+				load = LLVMBuildLoad2(builder,
+				    LLVMInt64TypeInContext(ctx), fuel, "fuel");
+				decr = LLVMBuildSub(builder, load,
+				    LLVMConstInt(LLVMInt64TypeInContext(ctx),
+					code - beg - code->arg, false),
+				    "decr");
+				LLVMBuildStore(builder, decr, fuel);
+				cmp = LLVMBuildICmp(builder, LLVMIntSLT, decr,
+				    LLVMConstInt(
+					LLVMInt64TypeInContext(ctx), 0, false),
+				    "cmp_fuel");
+				fueled_bb = LLVMAppendBasicBlockInContext(
+				    ctx, jitted_fun, "fueled");
+				br = LLVMBuildCondBr(
+				    builder, cmp, fuel_out_bb, fueled_bb);
+				lower_unlikely(ctx, br);
+				LLVMPositionBuilderAtEnd(builder, fueled_bb);
+			}
+
+			offset = LLVMBuildLoad2(builder,
+			    LLVMInt32TypeInContext(ctx), tape_ptr, "offset");
+			gep_args[0] = offset;
+			ele_ptr = LLVMBuildInBoundsGEP2(builder,
+			    LLVMInt8TypeInContext(ctx), mem, gep_args, 1,
+			    "ele_ptr");
+			load_ele = LLVMBuildLoad2(builder,
+			    LLVMInt8TypeInContext(ctx), ele_ptr, "load_ele");
+
+			if (trace && trace_wants(trace, code->arg))
+				lower_trace(builder, ctx, jitted_fun, trace,
+				    code->arg, offset, load_ele, BF_END_LOOP);
+
+			/* branch depending whether it's zero or not */
+			cmp = LLVMBuildICmp(builder, LLVMIntNE, load_ele,
+			    LLVMConstInt(LLVMInt8TypeInContext(ctx), 0, false),
+			    "cmp_not_zero");
+
+			/* if cmp is zero, then exit loop, else loop */
+			LLVMBuildCondBr(builder, cmp, loop_bb, exit_bb);
+
+			/* continue inserting bb's *after* loop body*/
+			LLVMPositionBuilderAtEnd(builder, exit_bb);
+			break;
+
+		default:
+			fprintf(stderr, "bf: bad opcode %d\n", code->op);
+			abort();
+			break;
+		}
+	}
+
+	lower_exit(builder, ctx, jitted_fun, tape_ptr, fuel, BF_DONE);
+
+	if (metered) {
+		LLVMPositionBuilderAtEnd(builder, fuel_out_bb);
+		lower_exit(
+		    builder, ctx, jitted_fun, tape_ptr, fuel, BF_OUT_OF_FUEL);
+	}
+
+	free(bb_stack);
+
+	if (verbose)
+		print_bb(jitted_fun);
+
+	return jitted_fun;
+}
+
+/* run the O2 pipeline over mod. Returns 0 on success. */
+int
+lower_optimize(LLVMModuleRef mod, LLVMValueRef fun)
+{
+	int status = 0;
+
+	LLVMPassManagerBuilderRef pass_builder = LLVMPassManagerBuilderCreate();
+	LLVMPassManagerBuilderSetOptLevel(pass_builder, 2);
+
+	LLVMPassManagerRef pm = LLVMCreatePassManager();
+	LLVMPassManagerRef fun_pm = LLVMCreateFunctionPassManagerForModule(mod);
+
+	LLVMPassManagerBuilderPopulateModulePassManager(pass_builder, pm);
+	LLVMPassManagerBuilderPopulateFunctionPassManager(pass_builder, fun_pm);
+
+	LLVMInitializeFunctionPassManager(fun_pm);
+
+	if (!LLVMRunFunctionPassManager(fun_pm, fun)) {
+		fprintf(stderr, "fun opt passes failed to apply\n");
+		status = 1;
+	} else if (!LLVMRunPassManager(pm, mod)) {
+		fprintf(stderr, "opt passes failed to apply\n");
+		status = 1;
+	}
+
+	LLVMFinalizeFunctionPassManager(fun_pm);
+	LLVMDisposePassManager(fun_pm);
+	LLVMDisposePassManager(pm);
+	LLVMPassManagerBuilderDispose(pass_builder);
+
+	return status;
+}
@@ -0,0 +1,358 @@
+/*
+ * Copyright 2021 ETH Zurich
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Author: Robert Balas (balasr@iis.ee.ethz.ch)
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "optimize.h"
+
+/*
+ * Dataflow optimizer over the bytecode. We track the values of cells relative
+ * to the head position at the start of a straight-line region and use them to
+ *  - turn additions to known cells into stores,
+ *  - drop stores that are overwritten before they are read (or never read),
+ *  - drop stores of the value the cell already holds,
+ *  - drop loops entered with a zero cell,
+ *  - print known cells as constants.
+ *
+ * Loops end a region. On entry we know nothing, on exit we only know that the
+ * current cell is zero. At the very start every cell is zero.
+ *
+ * Once nothing changes any more, runs of additions, stores and moves that
+ * touch several neighbouring cells become a single BF_MULTI.
+ */
+
+/* number of cells we track per region */
+#define OPT_CELLS 64
+
+/* cells are 8 bit in the jit and int in the interpreter. Values within this
+ * range are zero in one iff they are zero in the other. */
+#define IN_RANGE(v) ((v) > -256 && (v) < 256)
+
+struct cell {
+	int off;   /* relative to the start of the region */
+	bool known;
+	int val;
+	int store; /* last store not read yet, -1 if none */
+};
+
+struct state {
+	struct cell cells[OPT_CELLS];
+	int n;
+	int pos;   /* head relative to the start of the region */
+	bool zero; /* untracked cells are zero */
+};
+
+static void
+reset(struct state *s)
+{
+	s->n = 0;
+	s->pos = 0;
+	s->zero = false;
+}
+
+static struct cell *
+lookup(struct state *s)
+{
+	for (int i = 0; i < s->n; i++)
+		if (s->cells[i].off == s->pos)
+			return &s->cells[i];
+
+	/* out of space, forget everything we know about this region */
+	if (s->n == OPT_CELLS) {
+		int pos = s->pos;
+		reset(s);
+		s->pos = pos;
+	}
+
+	struct cell *c = &s->cells[s->n++];
+	*c = (struct cell) { s->pos, s->zero, 0, -1 };
+	return c;
+}
+
+/* remove the pending store to c, nothing ever reads it */
+static bool
+kill(struct bf_insn *code, struct cell *c)
+{
+	if (c->store < 0)
+		return false;
+	code[c->store].op = BF_NOP;
+	c->store = -1;
+	return true;
+}
+
+static bool
+propagate(struct bf_insn *code)
+{
+	struct state s;
+	bool changed = false;
+	struct cell *c;
+	int end;
+
+	reset(&s);
+	s.zero = true;
+
+	for (int i = 0; code[i].op != BF_HALT; i++) {
+		struct bf_insn *insn = &code[i];
+
+		switch (insn->op) {
+		case BF_ADD:
+			c = lookup(&s);
+			if (c->known && IN_RANGE(c->val + insn->arg)) {
+				changed |= kill(code, c);
+				c->val += insn->arg;
+				*insn = (struct bf_insn) { BF_SET, c->val };
+				changed = true;
+			} else {
+				/* reads the old value */
+				c->known = false;
+			}
+			c->store = i;
+			break;
+		case BF_SET:
+			c = lookup(&s);
+			if (c->known && c->val == insn->arg) {
+				insn->op = BF_NOP;
+				changed = true;
+				break;
+			}
+			changed |= kill(code, c);
+			c->known = true;
+			c->val = insn->arg;
+			c->store = i;
+			break;
+		case BF_IN:
+			/* has a side effect, so it is never a dead store */
+			c = lookup(&s);
+			changed |= kill(code, c);
+			c->known = false;
+			break;
+		case BF_OUT:
+			c = lookup(&s);
+			if (c->known) {
+				*insn = (struct bf_insn) { BF_PUTC, c->val };
+				changed = true;
+			} else {
+				c->store = -1;
+			}
+			break;
+		case BF_MOVE:
+			s.pos += insn->arg;
+			break;
+		case BF_LOOP:
+			c = lookup(&s);
+			if (c->known && c->val == 0) {
+				end = insn->arg;
+				for (int j = i; j <= end; j++)
+					code[j].op = BF_NOP;
+				i = end;
+				changed = true;
+				break;
+			}
+			/* the body may read anything */
+			reset(&s);
+			break;
+		case BF_END_LOOP:
+			reset(&s);
+			c = lookup(&s);
+			c->known = true;
+			c->val = 0;
+			break;
+		case BF_MULTI:
+			/* only formed at the very end, don't look inside */
+			reset(&s);
+			i += insn->arg;
+			break;
+		case BF_PUTC:
+		case BF_NOP:
+		case BF_HALT:
+			break;
+		}
+	}
+
+	/* the tape dies with the program */
+	for (int i = 0; i < s.n; i++)
+		changed |= kill(code, &s.cells[i]);
+
+	return changed;
+}
+
+/* squeeze out nops, merge what became adjacent and fix up loop targets */
+static bool
+compact(struct bf_insn *code)
+{
+	int len = 0;
+	while (code[len].op != BF_HALT)
+		len++;
+
+	int *loop_stack = malloc((len + 1) * sizeof(*loop_stack));
+	int n = 0;
+	int depth = 0;
+	int start;
+	int fence = 0; /* never merge into the slots of a BF_MULTI */
+
+	if (!loop_stack) {
+		perror("malloc");
+		abort();
+	}
+
+	for (int i = 0; i < len; i++) {
+		struct bf_insn insn = code[i];
+
+		switch (insn.op) {
+		case BF_NOP:
+			break;
+		case BF_ADD:
+		case BF_MOVE:
+			if (n > fence && code[n - 1].op == insn.op) {
+				code[n - 1].arg += insn.arg;
+				if (code[n - 1].arg == 0)
+					n--;
+			} else {
+				code[n++] = insn;
+			}
+			break;
+		case BF_LOOP:
+			loop_stack[depth++] = n;
+			code[n++] = insn;
+			break;
+		case BF_END_LOOP:
+			start = loop_stack[--depth];
+			code[start].arg = n;
+			code[n++] = (struct bf_insn) { BF_END_LOOP, start };
+			break;
+		case BF_MULTI:
+			for (int j = 0; j <= insn.arg; j++)
+				code[n++] = code[i + j];
+			i += insn.arg;
+			fence = n;
+			break;
+		default:
+			code[n++] = insn;
+			break;
+		}
+	}
+
+	code[n] = (struct bf_insn) { BF_HALT, 0 };
+	free(loop_stack);
+
+	return n != len;
+}
+
+/* turn the region of additions, stores and moves starting at i into a
+ * BF_MULTI if it updates at least two cells and that does not make it longer.
+ * Returns the end of the region. */
+static int
+multi(struct bf_insn *code, int i)
+{
+	struct bf_insn slots[BF_MULTI_MAX];
+	int pos = 0;
+	int lo = 0, hi = -1; /* window of touched cells, empty for now */
+	int cells = 0;
+	int end;
+
+	for (end = i; code[end].op == BF_ADD || code[end].op == BF_SET ||
+	     code[end].op == BF_MOVE;
+	     end++) {
+		struct bf_insn insn = code[end];
+
+		if (insn.op == BF_MOVE) {
+			pos += insn.arg;
+			continue;
+		}
+
+		if (hi < lo) {
+			lo = hi = pos;
+			slots[0] = (struct bf_insn) { BF_ADD, 0 };
+		}
+
+		/* widen the window, keeping slots[0] at lo */
+		int new_lo = pos < lo ? pos : lo;
+		int new_hi = pos > hi ? pos : hi;
+		if (new_hi - new_lo >= BF_MULTI_MAX)
+			break;
+		if (new_lo < lo) {
+			memmove(&slots[lo - new_lo], slots,
+			    (hi - lo + 1) * sizeof(*slots));
+			for (int j = 0; j < lo - new_lo; j++)
+				slots[j] = (struct bf_insn) { BF_ADD, 0 };
+		}
+		for (int j = hi + 1; j <= new_hi; j++)
+			slots[j - new_lo] = (struct bf_insn) { BF_ADD, 0 };
+		lo = new_lo;
+		hi = new_hi;
+
+		/* later updates of a cell compose with earlier ones */
+		struct bf_insn *slot = &slots[pos - lo];
+		if (insn.op == BF_SET)
+			*slot = insn;
+		else
+			slot->arg += insn.arg;
+	}
+
+	int width = hi - lo + 1;
+	for (int j = 0; j < width; j++)
+		cells += slots[j].op == BF_SET || slots[j].arg != 0;
+	int sz = (lo != 0) + 1 + width + (pos != lo);
+	if (cells < 2 || sz > end - i)
+		return end;
+
+	int n = i;
+	if (lo != 0)
+		code[n++] = (struct bf_insn) { BF_MOVE, lo };
+	code[n++] = (struct bf_insn) { BF_MULTI, width };
+	for (int j = 0; j < width; j++)
+		code[n++] = slots[j];
+	if (pos != lo)
+		code[n++] = (struct bf_insn) { BF_MOVE, pos - lo };
+	while (n < end)
+		code[n++] = (struct bf_insn) { BF_NOP, 0 };
+
+	return end;
+}
+
+void
+bf_optimize(struct bf_insn *code, bool trace)
+{
+	bool changed;
+
+	do {
+		changed = propagate(code);
+		changed |= compact(code);
+	} while (changed);
+
+	/* last, it hides cells from propagate() */
+	for (int i = 0; code[i].op != BF_HALT;) {
+		if (code[i].op == BF_ADD || code[i].op == BF_SET ||
+		    code[i].op == BF_MOVE)
+			i = multi(code, i);
+		else
+			i++;
+	}
+	compact(code);
+
+	if (trace) {
+		puts("optimize: result");
+		bf_print(code);
+	}
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2021 ETH Zurich
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Author: Robert Balas (balasr@iis.ee.ethz.ch)
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bytecode.h"
+#include "run.h"
+#include "tape.h"
+
+/* read the program at path into a null terminated buffer, exits on failure */
+char *
+run_read(const char *path)
+{
+	char *buffer = NULL;
+	size_t len = 0;
+	FILE *fp = fopen(path, "r");
+
+	if (!fp) {
+		fprintf(stderr, "%s does not exist\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	/* read into buffer and null terminate */
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	buffer = malloc(len + 1);
+	if (!buffer) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	len = fread(buffer, 1, len, fp);
+	buffer[len] = '\0';
+	fclose(fp);
+
+	return buffer;
+}
+
+/* run jitted code on a fresh tape and report if it ran out of fuel */
+int
+run(bf_jitted_fn fn, int64_t fuel)
+{
+	struct bf_tape *tape = tape_get(BF_MEM_SZ);
+	uint8_t *mem = tape->mem;
+	int32_t head = 0;
+
+	/* enter jitted code */
+	int status = fn(mem, &head, &fuel);
+
+	if (status == BF_OUT_OF_FUEL) {
+		/* keep whatever the program printed so far */
+		fflush(stdout);
+		fprintf(stderr, "bf: out of fuel at head %d", head);
+		if (head >= 0 && head < BF_MEM_SZ)
+			fprintf(stderr, ", cell %d", mem[head]);
+		fputc('\n', stderr);
+	}
+
+	/* used stays at the whole tape: the final head does not bound the cells
+	 * jitted code touched, and the cli only runs once per process anyway */
+	tape_put(tape);
+	return status == BF_DONE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright 2021 ETH Zurich
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Author: Robert Balas (balasr@iis.ee.ethz.ch)
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "tape.h"
+
+/* keep at most this many idle tapes around */
+#define TAPE_POOL_MAX 8
+/* give pages of a dirty range this large back to the kernel instead of
+ * clearing them, they come back zeroed on first touch */
+#define TAPE_MADVISE_MIN (32 * 1024)
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bf_tape *pool = NULL;
+static int pool_len = 0;
+
+static void
+tape_clean(struct bf_tape *tape)
+{
+	if (tape->used < TAPE_MADVISE_MIN) {
+		memset(tape->mem, 0, tape->used);
+	} else {
+		/* the whole pages past used are still clean */
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t len = (tape->used + page - 1) & ~(page - 1);
+		if (len > tape->sz)
+			len = tape->sz;
+		if (madvise(tape->mem, len, MADV_DONTNEED))
+			memset(tape->mem, 0, len);
+	}
+	tape->used = 0;
+}
+
+/* hand out a zeroed tape of at least sz bytes. The caller should lower used
+ * to the part of the tape it touched before putting it back, otherwise we
+ * assume all of it is dirty. */
+struct bf_tape *
+tape_get(size_t sz)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	sz = (sz + page - 1) & ~(page - 1);
+
+	pthread_mutex_lock(&pool_lock);
+	struct bf_tape **prev = &pool;
+	struct bf_tape *tape = pool;
+	while (tape && tape->sz != sz) {
+		prev = &tape->next;
+		tape = tape->next;
+	}
+	if (tape) {
+		*prev = tape->next;
+		pool_len--;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (tape) {
+		tape_clean(tape);
+	} else {
+		tape = malloc(sizeof(*tape));
+		if (!tape) {
+			perror("malloc");
+			abort();
+		}
+		/* fresh anonymous memory is already zero */
+		tape->mem = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (tape->mem == MAP_FAILED) {
+			perror("mmap");
+			abort();
+		}
+		tape->sz = sz;
+	}
+
+	tape->used = tape->sz;
+	tape->next = NULL;
+	return tape;
+}
+
+/* return a tape to the pool, it is cleaned once someone needs it again */
+void
+tape_put(struct bf_tape *tape)
+{
+	if (!tape)
+		return;
+
+	pthread_mutex_lock(&pool_lock);
+	bool keep = pool_len < TAPE_POOL_MAX;
+	if (keep) {
+		tape->next = pool;
+		pool = tape;
+		pool_len++;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (!keep) {
+		munmap(tape->mem, tape->sz);
+		free(tape);
+	}
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2021 ETH Zurich
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Author: Robert Balas (balasr@iis.ee.ethz.ch)
+ */
+
+/*
+ * Pool of zeroed tapes. A tape only remembers how much of it the last run may
+ * have dirtied and is cleaned lazily when it is handed out again, so the setup
+ * cost of a run is proportional to the cells the previous one used rather
+ * than to the size of the tape.
+ */
+
+struct bf_tape {
+	void *mem;
+	size_t sz;   /* in bytes, a multiple of the page size */
+	size_t used; /* bytes from the start that may be non-zero */
+	struct bf_tape *next;
+};
+
+struct bf_tape *tape_get(size_t sz);
+void tape_put(struct bf_tape *tape);
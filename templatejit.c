@@ -0,0 +1,359 @@
+/*
+ * Copyright 2021 ETH Zurich
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Author: Robert Balas (balasr@iis.ee.ethz.ch)
+ */
+
+#include <sys/mman.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "templatejit.h"
+#include "trace.h"
+
+/*
+ * Baseline x86-64 backend that does not need llvm. Every bytecode instruction
+ * maps to a pre-assembled machine code template. We copy the templates into an
+ * executable page and patch immediates, call targets and branch offsets in
+ * place. The generated code has the same interface as the llvm one (see
+ * bf_jitted_fn) and calls putchar() and getchar().
+ *
+ * Register usage: rbx holds the pointer to the current cell, r13 the start of
+ * the tape, r14 the remaining fuel and r12 counts down to the next sampled
+ * trace event. r15 and rbp point to where head and fuel are stored on exit.
+ * All of them are callee saved, so they survive calls into C.
+ */
+
+/* push rbx; push rbp; push r12; push r13; push r14; push r15; sub rsp, 8;
+ * mov rbx, rdi; mov r13, rdi; mov r15, rsi; mov rbp, rdx;
+ * movsxd rax, dword [rsi]; add rbx, rax; mov r14, [rbp]; mov r12d, imm32 */
+static const uint8_t prologue[] = { 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41,
+	0x56, 0x41, 0x57, 0x48, 0x83, 0xec, 0x08, 0x48, 0x89, 0xfb, 0x49, 0x89,
+	0xfd, 0x49, 0x89, 0xf7, 0x48, 0x89, 0xd5, 0x48, 0x63, 0x06, 0x48, 0x01,
+	0xc3, 0x4c, 0x8b, 0x75, 0x00, 0x41, 0xbc, 0x00, 0x00, 0x00, 0x00 };
+#define PROLOGUE_FUEL 32
+#define PROLOGUE_SAMPLE 38
+/* xor eax, eax; jmp exit; fuel_out: mov eax, BF_OUT_OF_FUEL; exit:
+ * mov rcx, rbx; sub rcx, r13; mov [r15], ecx; mov [rbp], r14; add rsp, 8;
+ * pop r15; pop r14; pop r13; pop r12; pop rbp; pop rbx; ret */
+static const uint8_t epilogue[] = { 0x31, 0xc0, 0xeb, 0x05, 0xb8, 0x01, 0x00,
+	0x00, 0x00, 0x48, 0x89, 0xd9, 0x4c, 0x29, 0xe9, 0x41, 0x89, 0x0f, 0x4c,
+	0x89, 0x75, 0x00, 0x48, 0x83, 0xc4, 0x08, 0x41, 0x5f, 0x41, 0x5e, 0x41,
+	0x5d, 0x41, 0x5c, 0x5d, 0x5b, 0xc3 };
+#define EPILOGUE_FUEL_OUT 4
+#define EPILOGUE_FUEL 18
+/* nop dword [rax + 0], replaces the fuel load and store when not metered */
+static const uint8_t nop4[] = { 0x0f, 0x1f, 0x40, 0x00 };
+/* add byte [rbx], imm8 */
+static const uint8_t add_tmpl[] = { 0x80, 0x03, 0x00 };
+#define ADD_IMM 2
+/* add rbx, imm32 */
+static const uint8_t move_tmpl[] = { 0x48, 0x81, 0xc3, 0x00, 0x00, 0x00, 0x00 };
+#define MOVE_IMM 3
+/* mov byte [rbx], imm8 */
+static const uint8_t set_tmpl[] = { 0xc6, 0x03, 0x00 };
+#define SET_IMM 2
+/* add byte [rbx + disp32], imm8 and mov byte [rbx + disp32], imm8 */
+static const uint8_t add_off_tmpl[] = { 0x80, 0x83, 0x00, 0x00, 0x00, 0x00,
+	0x00 };
+static const uint8_t set_off_tmpl[] = { 0xc6, 0x83, 0x00, 0x00, 0x00, 0x00,
+	0x00 };
+#define OFF_DISP 2
+#define OFF_IMM 6
+/* movzx edi, byte [rbx]; mov rax, imm64; call rax */
+static const uint8_t out_tmpl[] = { 0x0f, 0xb6, 0x3b, 0x48, 0xb8, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xd0 };
+#define OUT_FUN 5
+/* mov edi, imm32; mov rax, imm64; call rax */
+static const uint8_t putc_tmpl[] = { 0xbf, 0x00, 0x00, 0x00, 0x00, 0x48, 0xb8,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xd0 };
+#define PUTC_IMM 1
+#define PUTC_FUN 7
+/* mov rax, imm64; call rax; mov byte [rbx], al */
+static const uint8_t in_tmpl[] = { 0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0xff, 0xd0, 0x88, 0x03 };
+#define IN_FUN 2
+/* cmp byte [rbx], 0; je rel32 */
+static const uint8_t loop_tmpl[] = { 0x80, 0x3b, 0x00, 0x0f, 0x84, 0x00, 0x00,
+	0x00, 0x00 };
+/* cmp byte [rbx], 0; jne rel32 */
+static const uint8_t end_loop_tmpl[] = { 0x80, 0x3b, 0x00, 0x0f, 0x85, 0x00,
+	0x00, 0x00, 0x00 };
+#define JMP_REL 5
+/* sub r14, imm32; jl fuel_out */
+static const uint8_t fuel_tmpl[] = { 0x49, 0x81, 0xee, 0x00, 0x00, 0x00, 0x00,
+	0x0f, 0x8c, 0x00, 0x00, 0x00, 0x00 };
+#define FUEL_IMM 3
+#define FUEL_REL 9
+/* dec r12d; jz stub. The rest of the event is recorded out of line. */
+static const uint8_t trace_tmpl[] = { 0x41, 0xff, 0xcc, 0x0f, 0x84, 0x00, 0x00,
+	0x00, 0x00 };
+#define TRACE_REL 5
+/* stub: mov rdi, imm64; mov esi, imm32; mov rdx, rbx; sub rdx, r13;
+ * movzx ecx, byte [rbx]; mov r8d, imm32; mov rax, imm64; call rax;
+ * mov r12d, imm32; jmp back */
+static const uint8_t trace_stub_tmpl[] = { 0x48, 0xbf, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0xbe, 0x00, 0x00, 0x00, 0x00, 0x48, 0x89, 0xda,
+	0x4c, 0x29, 0xea, 0x0f, 0xb6, 0x0b, 0x41, 0xb8, 0x00, 0x00, 0x00, 0x00,
+	0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xd0,
+	0x41, 0xbc, 0x00, 0x00, 0x00, 0x00, 0xe9, 0x00, 0x00, 0x00, 0x00 };
+#define TRACE_PTR 2
+#define TRACE_PC 11
+#define TRACE_OP 26
+#define TRACE_FUN 32
+#define TRACE_SAMPLE 44
+#define TRACE_BACK 49
+
+/* upper bound on the size of a single template */
+#define TMPL_MAX_SZ 32
+
+static uint8_t *
+emit(uint8_t *p, const uint8_t *tmpl, size_t sz)
+{
+	memcpy(p, tmpl, sz);
+	return p + sz;
+}
+
+static void
+patch32(uint8_t *p, int32_t val)
+{
+	memcpy(p, &val, sizeof(val));
+}
+
+static void
+patch64(uint8_t *p, uint64_t val)
+{
+	memcpy(p, &val, sizeof(val));
+}
+
+/* a sampled loop event, recorded by a stub after the epilogue */
+struct trace_site {
+	uint8_t *at;
+	int pc;
+	enum bf_op op;
+};
+
+/* count down to the next sample for the loop starting at pc */
+static uint8_t *
+emit_trace(uint8_t *p, struct trace_site *site, int pc, enum bf_op op)
+{
+	*site = (struct trace_site) { p, pc, op };
+	return emit(p, trace_tmpl, sizeof(trace_tmpl));
+}
+
+/* call trace_record() and return to after the countdown at site */
+static uint8_t *
+emit_trace_stub(uint8_t *p, struct trace_site *site, struct bf_trace *trace)
+{
+	uint8_t *start = p;
+	uint8_t *back = site->at + sizeof(trace_tmpl);
+
+	p = emit(p, trace_stub_tmpl, sizeof(trace_stub_tmpl));
+	patch64(start + TRACE_PTR, (uint64_t)(uintptr_t)trace);
+	patch32(start + TRACE_PC, site->pc);
+	patch32(start + TRACE_OP, site->op);
+	patch64(start + TRACE_FUN, (uint64_t)(uintptr_t)&trace_record);
+	patch32(start + TRACE_SAMPLE, trace->hdr->sample);
+	patch32(start + TRACE_BACK, (int32_t)(back - p));
+	patch32(site->at + TRACE_REL, (int32_t)(start - back));
+	return p;
+}
+
+/* compile code, instrumenting loops if trace is not NULL and charging fuel at
+ * back-edges if metered */
+struct bf_template *
+template_compile(
+    struct bf_insn *code, struct bf_trace *trace, bool metered, bool verbose)
+{
+#if defined(__x86_64__)
+	int n = 0;
+	while (code[n].op != BF_HALT)
+		n++;
+
+	if (trace)
+		trace_bind(trace, code);
+
+	struct bf_template *tmpl = malloc(sizeof(*tmpl));
+	/* machine code offset of each instruction, for patching branches */
+	uint8_t **addr = malloc((n + 1) * sizeof(*addr));
+	/* fuel checks that need to learn where fuel_out is */
+	uint8_t **fuel_sites = malloc((n + 1) * sizeof(*fuel_sites));
+	int n_fuel = 0;
+	/* sampled loop events that need a stub */
+	struct trace_site *trace_sites = malloc(
+	    (n + 1) * sizeof(*trace_sites));
+	int n_trace = 0;
+	if (!tmpl || !addr || !fuel_sites || !trace_sites) {
+		perror("malloc");
+		abort();
+	}
+
+	tmpl->sz = sizeof(prologue) + sizeof(epilogue) +
+	    n * (TMPL_MAX_SZ +
+		    (trace ? sizeof(trace_tmpl) + sizeof(trace_stub_tmpl) :
+			     0) +
+		    (metered ? sizeof(fuel_tmpl) : 0));
+	uint8_t *buf = mmap(NULL, tmpl->sz, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		perror("mmap");
+		abort();
+	}
+
+	uint8_t *p = emit(buf, prologue, sizeof(prologue));
+	patch32(buf + PROLOGUE_SAMPLE, trace ? trace->hdr->sample : 1);
+	/* unmetered code may get a NULL fuel pointer */
+	if (!metered)
+		emit(buf + PROLOGUE_FUEL, nop4, sizeof(nop4));
+
+	for (int i = 0; i < n; i++) {
+		struct bf_insn *insn = &code[i];
+		uint8_t *body;
+
+		/* charge a whole iteration at once, before the loop test */
+		if (metered && insn->op == BF_END_LOOP &&
+		    !bf_loop_bounded(code, insn->arg)) {
+			fuel_sites[n_fuel++] = p;
+			p = emit(p, fuel_tmpl, sizeof(fuel_tmpl));
+			patch32(fuel_sites[n_fuel - 1] + FUEL_IMM,
+			    i - insn->arg);
+		}
+
+		/* record before the loop test, back-edges skip the one at [ */
+		if (trace && insn->op == BF_LOOP && trace_wants(trace, i))
+			p = emit_trace(
+			    p, &trace_sites[n_trace++], i, BF_LOOP);
+		if (trace && insn->op == BF_END_LOOP &&
+		    trace_wants(trace, insn->arg))
+			p = emit_trace(p, &trace_sites[n_trace++],
+			    insn->arg, BF_END_LOOP);
+
+		addr[i] = p;
+
+		switch (insn->op) {
+		case BF_ADD:
+			p = emit(p, add_tmpl, sizeof(add_tmpl));
+			addr[i][ADD_IMM] = (uint8_t)insn->arg;
+			break;
+		case BF_MOVE:
+			p = emit(p, move_tmpl, sizeof(move_tmpl));
+			patch32(addr[i] + MOVE_IMM, insn->arg);
+			break;
+		case BF_SET:
+			p = emit(p, set_tmpl, sizeof(set_tmpl));
+			addr[i][SET_IMM] = (uint8_t)insn->arg;
+			break;
+		case BF_MULTI:
+			/* one update per changed cell, without moving rbx */
+			for (int j = 0; j < insn->arg; j++) {
+				struct bf_insn *slot = &insn[1 + j];
+				if (slot->op == BF_ADD && !(uint8_t)slot->arg)
+					continue;
+				uint8_t *at = p;
+				p = emit(p,
+				    slot->op == BF_SET ? set_off_tmpl :
+							 add_off_tmpl,
+				    sizeof(add_off_tmpl));
+				patch32(at + OFF_DISP, j);
+				at[OFF_IMM] = (uint8_t)slot->arg;
+			}
+			i += insn->arg;
+			break;
+		case BF_OUT:
+			p = emit(p, out_tmpl, sizeof(out_tmpl));
+			patch64(addr[i] + OUT_FUN,
+			    (uint64_t)(uintptr_t)&putchar);
+			break;
+		case BF_PUTC:
+			p = emit(p, putc_tmpl, sizeof(putc_tmpl));
+			patch32(addr[i] + PUTC_IMM, insn->arg);
+			patch64(addr[i] + PUTC_FUN,
+			    (uint64_t)(uintptr_t)&putchar);
+			break;
+		case BF_IN:
+			p = emit(p, in_tmpl, sizeof(in_tmpl));
+			patch64(addr[i] + IN_FUN,
+			    (uint64_t)(uintptr_t)&getchar);
+			break;
+		case BF_LOOP:
+			/* forward branch, patched at the matching ] */
+			p = emit(p, loop_tmpl, sizeof(loop_tmpl));
+			break;
+		case BF_END_LOOP:
+			p = emit(p, end_loop_tmpl, sizeof(end_loop_tmpl));
+			/* jump back to the body of the loop ... */
+			body = addr[insn->arg] + sizeof(loop_tmpl);
+			patch32(addr[i] + JMP_REL, (int32_t)(body - p));
+			/* ... and let [ skip to after this ] */
+			patch32(addr[insn->arg] + JMP_REL, (int32_t)(p - body));
+			break;
+		default:
+			fprintf(stderr, "bf: bad opcode %d\n", insn->op);
+			abort();
+		}
+	}
+
+	uint8_t *fuel_out = p + EPILOGUE_FUEL_OUT;
+	p = emit(p, epilogue, sizeof(epilogue));
+	if (!metered)
+		emit(p - sizeof(epilogue) + EPILOGUE_FUEL, nop4, sizeof(nop4));
+	for (int i = 0; i < n_fuel; i++)
+		patch32(fuel_sites[i] + FUEL_REL,
+		    (int32_t)(fuel_out - (fuel_sites[i] + sizeof(fuel_tmpl))));
+
+	/* keep the rarely taken trace calls out of the loops */
+	for (int i = 0; i < n_trace; i++)
+		p = emit_trace_stub(p, &trace_sites[i], trace);
+
+	free(trace_sites);
+	free(fuel_sites);
+	free(addr);
+
+	if (verbose)
+		printf("template: emitted %zu bytes for %d instructions\n",
+		    (size_t)(p - buf), n);
+
+	if (mprotect(buf, tmpl->sz, PROT_READ | PROT_EXEC)) {
+		perror("mprotect");
+		abort();
+	}
+
+	tmpl->buf = buf;
+	tmpl->fn = (bf_jitted_fn)buf;
+	return tmpl;
+#else
+	(void)code;
+	(void)trace;
+	(void)metered;
+	(void)verbose;
+	fprintf(stderr, "bf: template jit only supports x86-64\n");
+	abort();
+#endif
+}
+
+void
+template_free(struct bf_template *tmpl)
+{
+	if (!tmpl)
+		return;
+	munmap(tmpl->buf, tmpl->sz);
+	free(tmpl);
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright 2021 ETH Zurich
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Author: Robert Balas (balasr@iis.ee.ethz.ch)
+ */
+
+struct bf_trace;
+
+struct bf_template {
+	uint8_t *buf;
+	size_t sz;
+	bf_jitted_fn fn;
+};
+
+struct bf_template *template_compile(
+    struct bf_insn *code, struct bf_trace *trace, bool metered, bool verbose);
+void template_free(struct bf_template *tmpl);
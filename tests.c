@@ -17,30 +17,312 @@
  * Author: Robert Balas (balasr@iis.ee.ethz.ch)
  */
 
+#include <llvm-c/Analysis.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/ExecutionEngine.h>
+#include <llvm-c/Target.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "bytecode.h"
 #include "interpreter.h"
+#include "lower.h"
+#include "optimize.h"
+#include "tape.h"
+#include "templatejit.h"
+#include "trace.h"
+
+/* send stdout to a temporary file until release() */
+static FILE *
+capture(int *saved)
+{
+	FILE *fp = tmpfile();
+	if (!fp) {
+		perror("tmpfile");
+		abort();
+	}
+	fflush(stdout);
+	*saved = dup(STDOUT_FILENO);
+	dup2(fileno(fp), STDOUT_FILENO);
+	return fp;
+}
+
+static void
+release(int saved)
+{
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+}
+
+/* read stdin from a temporary file holding in, rewind(stdin) starts over */
+static void
+feed(const char *in)
+{
+	FILE *fp = tmpfile();
+	if (!fp) {
+		perror("tmpfile");
+		abort();
+	}
+	fputs(in, fp);
+	fflush(fp);
+	dup2(fileno(fp), STDIN_FILENO);
+	fclose(fp);
+}
+
+/* whether two captured outputs are the same */
+static bool
+same_output(FILE *a, FILE *b)
+{
+	int c;
+
+	rewind(a);
+	rewind(b);
+	while ((c = fgetc(a)) != EOF)
+		if (c != fgetc(b))
+			return false;
+	return fgetc(b) == EOF;
+}
+
+static void
+run_template(struct bf_template *tmpl)
+{
+	uint8_t *mem = calloc(BF_MEM_SZ, 1);
+	int32_t head = 0;
+	int64_t fuel = 0;
+
+	if (!mem) {
+		perror("calloc");
+		abort();
+	}
+	tmpl->fn(mem, &head, &fuel);
+	free(mem);
+}
+
+/* lower, verify, optimize and run code the way brain2llvm does */
+static void
+run_llvm(struct bf_insn *code)
+{
+	LLVMContextRef ctx = LLVMContextCreate();
+	LLVMModuleRef mod = LLVMModuleCreateWithNameInContext("tests", ctx);
+	LLVMValueRef fun = lower(code, mod, ctx, "jitted", NULL, false, false);
+
+	char *error = NULL;
+	LLVMVerifyModule(mod, LLVMAbortProcessAction, &error);
+	LLVMDisposeMessage(error);
+	if (lower_optimize(mod, fun))
+		abort();
+
+	LLVMExecutionEngineRef engine;
+	if (LLVMCreateExecutionEngineForModule(&engine, mod, &error)) {
+		fprintf(stderr, "bf: %s\n", error);
+		abort();
+	}
+	bf_jitted_fn fn = (bf_jitted_fn)(uintptr_t)LLVMGetFunctionAddress(
+	    engine, "jitted");
+
+	uint8_t *mem = calloc(BF_MEM_SZ, 1);
+	int32_t head = 0;
+
+	if (!mem) {
+		perror("calloc");
+		abort();
+	}
+	fn(mem, &head, NULL);
+	free(mem);
+	/* the engine owns the module */
+	LLVMDisposeExecutionEngine(engine);
+	LLVMContextDispose(ctx);
+}
 
 int
 main(void)
 {
 	/* trivial loop */
-	interpret("[-]", true);
+	interpret("[-]", NULL, NULL);
 
 	/* hello world */
 	interpret(
 	    ">++++++++[<+++++++++>-]<.>++++[<+++++++>-]<+.+++++++..+++.>>++++++[<+++++++>-]<++.------------.>++++++[<+++++++++>-]<+.<.+++.------.--------.>>>++++[<++++++++>-]<+.",
-	    false);
+	    NULL, NULL);
 	puts("");
 
-	/* count to five */
+	/* count to five, tracing one loop entry and five back-edges */
+	struct bf_trace *trace = trace_open("tests-trace.bin", 1, -1);
+	if (!trace)
+		return EXIT_FAILURE;
 	interpret(
 	    "++++++++ ++++++++ ++++++++ ++++++++ ++++++++ ++++++++ >+++++ [<+.>-]",
+	    trace, NULL);
+	puts("");
+	if (trace->hdr->count != 6) {
+		fprintf(stderr, "trace has %lu records, expected 6\n",
+		    (unsigned long)trace->hdr->count);
+		return EXIT_FAILURE;
+	}
+	trace_close(trace);
+
+	/* hello world with the baseline template jit */
+	struct bf_insn *code = bf_compile(
+	    ">++++++++[<+++++++++>-]<.>++++[<+++++++>-]<+.+++++++..+++.>>++++++[<+++++++>-]<++.------------.>++++++[<+++++++++>-]<+.<.+++.------.--------.>>>++++[<++++++++>-]<+.",
 	    false);
+	struct bf_template *tmpl = template_compile(code, NULL, false, false);
+	uint8_t *mem = calloc(BF_MEM_SZ, 1);
+	int32_t head = 0;
+	/* unmetered code never touches fuel */
+	tmpl->fn(mem, &head, NULL);
+	template_free(tmpl);
+	free(code);
 	puts("");
 
+	/* runaway loops stop once they run out of fuel, with the tape intact */
+	int64_t fuel = 1000;
+	if (interpret("+[>+<]", NULL, &fuel) != BF_OUT_OF_FUEL) {
+		fprintf(stderr, "interpreter did not run out of fuel\n");
+		return EXIT_FAILURE;
+	}
+	code = bf_compile("+[>+<]", false);
+	tmpl = template_compile(code, NULL, true, false);
+	memset(mem, 0, BF_MEM_SZ);
+	head = 0;
+	fuel = 1000;
+	if (tmpl->fn(mem, &head, &fuel) != BF_OUT_OF_FUEL || head != 0 ||
+	    mem[1] != (uint8_t)(1000 / 4 + 1)) {
+		fprintf(stderr, "template jit did not run out of fuel\n");
+		return EXIT_FAILURE;
+	}
+	template_free(tmpl);
+	free(code);
+
+	/* scans finish or leave the tape, the jits do not charge them */
+	code = bf_compile(",[>[->+<]<<]", false);
+	if (!bf_loop_bounded(code, 1) || bf_loop_counted(code, 1) ||
+	    !bf_loop_counted(code, 3)) {
+		fprintf(stderr, "scan loop not bounded\n");
+		return EXIT_FAILURE;
+	}
+	free(code);
+
+	/* neighbouring cell updates become a single multi-cell update */
+	code = bf_compile("+++[>+>++>+++<<<-]", false);
+	bf_optimize(code, false);
+	tmpl = template_compile(code, NULL, false, false);
+	memset(mem, 0, BF_MEM_SZ);
+	head = 0;
+	tmpl->fn(mem, &head, &fuel);
+	if (code[2].op != BF_MULTI || code[2].arg != 4 || mem[0] != 0 ||
+	    mem[1] != 3 || mem[2] != 6 || mem[3] != 9) {
+		fprintf(stderr, "multi-cell update failed\n");
+		bf_print(code);
+		return EXIT_FAILURE;
+	}
+	/* the counter now lives in a multi slot, the loop is still bounded */
+	if (!bf_loop_bounded(code, 1)) {
+		fprintf(stderr, "multi-cell loop not bounded\n");
+		return EXIT_FAILURE;
+	}
+	template_free(tmpl);
+	free(code);
+	free(mem);
+
+	/* and the interpreter prints what the multi-cell update computed */
+	int saved;
+	FILE *out = capture(&saved);
+	interpret("++++++++[>++++++>+++++++>++++++++<<<-]>.>.>.", NULL, NULL);
+	release(saved);
+	char printed[4] = { 0 };
+	rewind(out);
+	if (!fgets(printed, sizeof(printed), out) || strcmp(printed, "08@")) {
+		fprintf(stderr, "interpreter multi-cell update printed %s\n",
+		    printed);
+		return EXIT_FAILURE;
+	}
+	fclose(out);
+
+	/* llvm updates the cells of a multi as one vector, except in counted
+	 * loops, and has to print the same as the interpreter either way */
+	LLVMLinkInMCJIT();
+	LLVMInitializeNativeTarget();
+	LLVMInitializeNativeAsmPrinter();
+	feed("A");
+	char *multi[] = {
+		",[>+>++>+++>----<<<<[-]]>.>.>.>.",
+		"++++++++[>++++++>+++++++>++++++++<<<-]>.>.>.",
+	};
+	for (size_t i = 0; i < sizeof(multi) / sizeof(*multi); i++) {
+		rewind(stdin);
+		FILE *want = capture(&saved);
+		interpret(multi[i], NULL, NULL);
+		release(saved);
+
+		rewind(stdin);
+		FILE *got = capture(&saved);
+		code = bf_compile(multi[i], false);
+		bf_optimize(code, false);
+		if (code[2].op != BF_MULTI ||
+		    bf_loop_counted(code, 1) != (i == 1)) {
+			release(saved);
+			fprintf(stderr, "%s is not the multi loop we want\n",
+			    multi[i]);
+			bf_print(code);
+			return EXIT_FAILURE;
+		}
+		run_llvm(code);
+		free(code);
+		release(saved);
+
+		if (!same_output(want, got)) {
+			fprintf(stderr, "llvm printed something else for %s\n",
+			    multi[i]);
+			return EXIT_FAILURE;
+		}
+		fclose(want);
+		fclose(got);
+	}
+
+	/* dead stores and loops go away, the output becomes a constant */
+	code = bf_compile("[-]++[-]+++.[>+<-]>[+]", false);
+	bf_optimize(code, false);
+	if (code[0].op != BF_SET || code[0].arg != 3 ||
+	    code[1].op != BF_PUTC || code[1].arg != 3) {
+		fprintf(stderr, "optimizer failed\n");
+		bf_print(code);
+		return EXIT_FAILURE;
+	}
+	free(code);
+
+	/* syntax errors are reported, not fatal */
+	char err[64];
+	if (bf_try_compile("+\n+[", false, err, sizeof(err)) ||
+	    strcmp(err, "2:2: unmatched '['")) {
+		fprintf(stderr, "expected syntax error\n");
+		return EXIT_FAILURE;
+	}
+
+	/* recycled tapes come back zeroed, whether or not we say what we used */
+	struct bf_tape *tape = tape_get(BF_MEM_SZ);
+	uint8_t *first = tape->mem;
+	uint8_t *cells = first;
+	cells[0] = cells[100] = 1;
+	tape->used = 101;
+	tape_put(tape);
+	tape = tape_get(BF_MEM_SZ);
+	cells = tape->mem;
+	cells[BF_MEM_SZ - 1] = 1;
+	tape_put(tape);
+	tape = tape_get(BF_MEM_SZ);
+	cells = tape->mem;
+	if (cells != first || cells[0] || cells[100] ||
+	    cells[BF_MEM_SZ - 1]) {
+		fprintf(stderr, "tape not cleaned\n");
+		return EXIT_FAILURE;
+	}
+	tape_put(tape);
+
 	/* mandelbrot */
 	FILE *fp = fopen("mandelbrot.bf", "r");
 	char *buffer = NULL;
@@ -64,8 +346,36 @@ main(void)
 		buffer[len] = '\0';
 
 		fclose(fp);
-		/* run */
-		interpret(buffer, false);
+
+		/* the template jit has to print exactly what the interpreter
+		 * does */
+		FILE *want = capture(&saved);
+		interpret(buffer, NULL, NULL);
+		release(saved);
+
+		FILE *got = capture(&saved);
+		code = bf_compile(buffer, false);
+		bf_optimize(code, false);
+		tmpl = template_compile(code, NULL, false, false);
+		run_template(tmpl);
+		template_free(tmpl);
+		free(code);
+		release(saved);
+
+		rewind(want);
+		rewind(got);
+		int c, n = 0;
+		while ((c = fgetc(want)) != EOF && c == fgetc(got)) {
+			putchar(c);
+			n++;
+		}
+		if (c != EOF || fgetc(got) != EOF || n == 0) {
+			fprintf(stderr, "template jit output differs\n");
+			return EXIT_FAILURE;
+		}
+		fclose(want);
+		fclose(got);
+		free(buffer);
 	}
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,159 @@
+/*
+ * Copyright 2021 ETH Zurich
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Author: Robert Balas (balasr@iis.ee.ethz.ch)
+ */
+
+#include <sys/mman.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "trace.h"
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* record every sample'th event. If loop is not negative only events within
+ * that loop are recorded. Returns NULL on failure. */
+struct bf_trace *
+trace_open(const char *path, unsigned sample, int loop)
+{
+	struct bf_trace *t = malloc(sizeof(*t));
+	if (!t) {
+		perror("malloc");
+		return NULL;
+	}
+
+	t->map_sz = sizeof(struct bf_trace_hdr) +
+	    TRACE_RECS * sizeof(struct bf_trace_rec);
+
+	t->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (t->fd < 0) {
+		perror(path);
+		free(t);
+		return NULL;
+	}
+
+	if (ftruncate(t->fd, t->map_sz)) {
+		perror("ftruncate");
+		close(t->fd);
+		free(t);
+		return NULL;
+	}
+
+	t->hdr = mmap(NULL, t->map_sz, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    t->fd, 0);
+	if (t->hdr == MAP_FAILED) {
+		perror("mmap");
+		close(t->fd);
+		free(t);
+		return NULL;
+	}
+
+	t->hdr->magic = TRACE_MAGIC;
+	t->hdr->size = TRACE_RECS;
+	t->hdr->count = 0;
+	t->hdr->sample = sample ? sample : 1;
+	t->hdr->loop = loop;
+	t->recs = (struct bf_trace_rec *)(t->hdr + 1);
+
+	t->countdown = t->hdr->sample;
+	t->last = now_ns();
+	t->lo = 0;
+	t->hi = INT_MAX;
+	t->code = NULL;
+
+	return t;
+}
+
+/* resolve the loop filter against the program we are about to run */
+void
+trace_bind(struct bf_trace *t, struct bf_insn *code)
+{
+	int loop = t->hdr->loop;
+
+	t->code = code;
+	if (loop < 0)
+		return;
+
+	for (int i = 0; i <= loop; i++) {
+		if (code[i].op == BF_HALT) {
+			fprintf(stderr, "bf: trace loop %d out of range\n",
+			    loop);
+			abort();
+		}
+	}
+	if (code[loop].op != BF_LOOP) {
+		fprintf(stderr, "bf: trace loop %d is not a loop\n", loop);
+		abort();
+	}
+
+	t->lo = loop;
+	t->hi = code[loop].arg;
+}
+
+/* whether the jits need to instrument the loop at pc at all. They leave out
+ * the loops bf_loop_bounded() accepts, which always finish and are counted
+ * towards the enclosing loop, unless a loop filter asks for them. */
+bool
+trace_wants(struct bf_trace *t, int pc)
+{
+	if (pc < t->lo || pc > t->hi)
+		return false;
+	return t->hdr->loop >= 0 || !bf_loop_bounded(t->code, pc);
+}
+
+/* unconditionally record an event. The jits filter at compile time and keep
+ * their own sampling countdown, so they call this directly. */
+void
+trace_record(struct bf_trace *t, int pc, int head, int val, int op)
+{
+	uint64_t now = now_ns();
+	struct bf_trace_rec *rec = &t->recs[t->hdr->count &
+	    (t->hdr->size - 1)];
+
+	rec->pc = pc;
+	rec->op = op;
+	rec->head = head;
+	rec->val = val;
+	rec->dt = now - t->last;
+
+	t->last = now;
+	t->hdr->count++;
+}
+
+void
+trace_close(struct bf_trace *t)
+{
+	if (!t)
+		return;
+	munmap(t->hdr, t->map_sz);
+	close(t->fd);
+	free(t);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2021 ETH Zurich
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Author: Robert Balas (balasr@iis.ee.ethz.ch)
+ */
+
+/*
+ * Binary execution trace. Engines record an event every time they test a loop
+ * condition, i.e. when entering (or skipping) a loop and on every back-edge.
+ * Records go to a ring buffer in a mmap'd file, so the trace survives an
+ * abort() and can be decoded with bftrace afterwards.
+ */
+
+#define TRACE_MAGIC 0x32544642 /* "BFT2", 64-bit deltas */
+#define TRACE_RECS (1 << 20)
+
+struct bf_trace_rec {
+	uint32_t pc : 28; /* bytecode index of the loop start */
+	uint32_t op : 4;  /* BF_LOOP or BF_END_LOOP */
+	int32_t head;
+	int32_t val;	  /* cell under the head */
+	uint64_t dt;	  /* nanoseconds since the previous record */
+};
+
+struct bf_trace_hdr {
+	uint32_t magic;
+	uint32_t size;	/* number of records, a power of two */
+	uint64_t count; /* records written, the ring wraps at size */
+	uint32_t sample;
+	int32_t loop;
+};
+
+struct bf_trace {
+	struct bf_trace_hdr *hdr;
+	struct bf_trace_rec *recs;
+	size_t map_sz;
+	int fd;
+	uint32_t countdown;   /* events until the next sample */
+	uint64_t last;	      /* timestamp of the last record */
+	int lo, hi;	      /* only record loops within [lo, hi] */
+	struct bf_insn *code; /* program passed to trace_bind() */
+};
+
+struct bf_trace *trace_open(const char *path, unsigned sample, int loop);
+void trace_bind(struct bf_trace *t, struct bf_insn *code);
+bool trace_wants(struct bf_trace *t, int pc);
+void trace_record(struct bf_trace *t, int pc, int head, int val, int op);
+void trace_close(struct bf_trace *t);
+
+/* filter and sample an event, used by the interpreter. Inline, so only the
+ * sampled events pay for a call. */
+static inline void
+trace_event(struct bf_trace *t, int pc, int head, int val, int op)
+{
+	if (pc < t->lo || pc > t->hi)
+		return;
+	if (--t->countdown)
+		return;
+	t->countdown = t->hdr->sample;
+
+	trace_record(t, pc, head, val, op);
+}